@@ -0,0 +1,438 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+
+/*
+ * Precompiled config images.
+ *
+ * An image consists of a header followed by the parsed config and the
+ * arrays it refers to, each section being aligned to 8 bytes:
+ *
+ *	struct image_header
+ *	struct config		(with all pointers cleared)
+ *	struct config_source	[nr_sources]
+ *	struct descriptor	[keymap_sz]
+ *	struct chord		[chords_sz]
+ *	struct macro_entry	[macro_sz]
+ *
+ * Images are only valid for the build which produced them (the version and
+ * struct sizes are checked on load), and only for as long as none of the
+ * files the config was read from have changed.
+ */
+
+#include "keyd.h"
+
+#define IMAGE_MAGIC	"keydimg"
+#define IMAGE_VERSION	1
+#define IMAGE_SUFFIX	".bin"
+
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct image_header {
+	char magic[8];
+	uint32_t version;
+
+	/* Guard against layout changes between builds. */
+	uint32_t config_sz;
+	uint32_t descriptor_sz;
+	uint32_t chord_sz;
+
+	uint64_t nr_sources;
+	uint64_t keymap_sz;
+	uint64_t chords_sz;
+	uint64_t macro_sz;
+};
+
+static size_t image_size(const struct image_header *hdr)
+{
+	return ALIGN(sizeof(struct image_header)) +
+		ALIGN(sizeof(struct config)) +
+		ALIGN(hdr->nr_sources * sizeof(struct config_source)) +
+		ALIGN(hdr->keymap_sz * sizeof(struct descriptor)) +
+		ALIGN(hdr->chords_sz * sizeof(struct chord)) +
+		ALIGN(hdr->macro_sz * sizeof(struct macro_entry));
+}
+
+static int write_section(FILE *fh, const void *data, size_t sz)
+{
+	static const char pad[8];
+
+	if (sz && fwrite(data, sz, 1, fh) != 1)
+		return -1;
+
+	if (ALIGN(sz) != sz && fwrite(pad, ALIGN(sz) - sz, 1, fh) != 1)
+		return -1;
+
+	return 0;
+}
+
+static void image_path(const char *path, char *buf, size_t sz)
+{
+	snprintf(buf, sz, "%s%s", path, IMAGE_SUFFIX);
+}
+
+/*
+ * Writes an image of the given config alongside its config file.
+ * Returns 0 on success.
+ */
+int config_save_image(const struct config *config, const char *path)
+{
+	FILE *fh;
+	struct config copy;
+	char tmp[PATH_MAX+16];
+	char target[PATH_MAX+8];
+	struct image_header hdr = {
+		.magic = IMAGE_MAGIC,
+		.version = IMAGE_VERSION,
+		.config_sz = sizeof(struct config),
+		.descriptor_sz = sizeof(struct descriptor),
+		.chord_sz = sizeof(struct chord),
+		.nr_sources = config->nr_sources,
+		.keymap_sz = config->keymap_sz,
+		.chords_sz = config->chords_sz,
+		.macro_sz = config->macro_arena.sz,
+	};
+
+	copy = *config;
+	copy.keymap = NULL;
+	copy.chords = NULL;
+	copy.chord_index = NULL;
+	copy.sources = NULL;
+	copy.image = NULL;
+	copy.image_sz = 0;
+	memset(&copy.macro_arena, 0, sizeof copy.macro_arena);
+
+	image_path(path, target, sizeof target);
+	snprintf(tmp, sizeof tmp, "%s.tmp", target);
+
+	if (!(fh = fopen(tmp, "w"))) {
+		err("failed to create image: %s", strerror(errno));
+		return -1;
+	}
+
+	if (write_section(fh, &hdr, sizeof hdr) ||
+	    write_section(fh, &copy, sizeof copy) ||
+	    write_section(fh, config->sources, hdr.nr_sources * sizeof(struct config_source)) ||
+	    write_section(fh, config->keymap, hdr.keymap_sz * sizeof(struct descriptor)) ||
+	    write_section(fh, config->chords, hdr.chords_sz * sizeof(struct chord)) ||
+	    write_section(fh, config->macro_arena.entries, hdr.macro_sz * sizeof(struct macro_entry))) {
+		err("failed to write image: %s", strerror(errno));
+		fclose(fh);
+		unlink(tmp);
+		return -1;
+	}
+
+	if (fclose(fh) || rename(tmp, target)) {
+		err("failed to write image: %s", strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns 0 if idx is a valid index into an array of sz elements. */
+static int check_index(int idx, size_t sz)
+{
+	return idx >= 0 && (size_t)idx < sz ? 0 : -1;
+}
+
+static int check_descriptor(const struct config *config, const struct descriptor *d)
+{
+	const union descriptor_arg *args = d->args;
+
+	switch (d->op) {
+	case OP_LAYER:
+	case OP_LAYOUT:
+	case OP_ONESHOT:
+	case OP_SWAP:
+	case OP_TOGGLE:
+		return check_index(args[0].idx, config->nr_layers);
+	case OP_LAYERM:
+	case OP_ONESHOTM:
+	case OP_SWAPM:
+	case OP_TOGGLEM:
+		return check_index(args[0].idx, config->nr_layers) ||
+			check_index(args[1].idx, config->nr_macros);
+	case OP_ONESHOTK:
+	case OP_OVERLOAD:
+	case OP_OVERLOAD_TIMEOUT:
+	case OP_OVERLOAD_TIMEOUT_TAP:
+		return check_index(args[0].idx, config->nr_layers) ||
+			check_index(args[1].idx, config->nr_descriptors);
+	case OP_OVERLOAD_IDLE_TIMEOUT:
+		return check_index(args[0].idx, config->nr_descriptors) ||
+			check_index(args[1].idx, config->nr_descriptors);
+	case OP_TIMEOUT:
+		return check_index(args[0].idx, config->nr_descriptors) ||
+			check_index(args[2].idx, config->nr_descriptors);
+	case OP_CLEARM:
+	case OP_MACRO:
+		return check_index(args[0].idx, config->nr_macros);
+	case OP_MACRO2:
+		return check_index(args[2].idx, config->nr_macros);
+	case OP_COMMAND:
+		return check_index(args[0].idx, config->nr_commands);
+	default:
+		return d->op > OP_SCROLL ? -1 : 0;
+	}
+}
+
+/*
+ * Verifies that the indices and offsets within a loaded config refer to
+ * data which actually exists, so that a corrupt image cannot cause
+ * out of bounds accesses later on. Returns 0 if the config is sound.
+ */
+static int check_config(const struct config *config)
+{
+	size_t i, j;
+
+	if (!config->nr_layers || config->nr_layers > MAX_LAYERS ||
+	    config->nr_descriptors > ARRAY_SIZE(config->descriptors) ||
+	    config->nr_macros > ARRAY_SIZE(config->macros) ||
+	    config->nr_commands > ARRAY_SIZE(config->commands) ||
+	    config->nr_ids > ARRAY_SIZE(config->ids))
+		return -1;
+
+	for (i = 0; i < config->nr_layers; i++) {
+		const struct layer *layer = &config->layers[i];
+		size_t nr_entries = 0;
+
+		if (!memchr(layer->name, 0, sizeof layer->name))
+			return -1;
+
+		for (j = 0; j < ARRAY_SIZE(layer->keymap_mask); j++) {
+			if (layer->keymap_rank[j] != nr_entries)
+				return -1;
+
+			nr_entries += __builtin_popcountll(layer->keymap_mask[j]);
+		}
+
+		if (layer->keymap_start > config->keymap_sz ||
+		    nr_entries > config->keymap_sz - layer->keymap_start)
+			return -1;
+
+		if (layer->nr_chords > MAX_CHORDS ||
+		    layer->chords_start > config->chords_sz ||
+		    layer->nr_chords > config->chords_sz - layer->chords_start)
+			return -1;
+
+		if (layer->nr_constituents > ARRAY_SIZE(layer->constituents))
+			return -1;
+
+		for (j = 0; j < layer->nr_constituents; j++)
+			if (check_index(layer->constituents[j], config->nr_layers))
+				return -1;
+	}
+
+	for (i = 0; i < config->nr_macros; i++) {
+		const struct macro_ref *ref = &config->macros[i];
+
+		if (ref->off > config->macro_arena.sz ||
+		    ref->sz > config->macro_arena.sz - ref->off)
+			return -1;
+	}
+
+	for (i = 0; i < config->macro_arena.sz; i++) {
+		const struct macro_entry *ent = &config->macro_arena.entries[i];
+
+		if (ent->type > MACRO_TIMEOUT ||
+		    (ent->type == MACRO_UNICODE && ent->data >= UNICODE_NR_SEQUENCES))
+			return -1;
+	}
+
+	for (i = 0; i < config->nr_commands; i++)
+		if (!memchr(config->commands[i].cmd, 0, sizeof config->commands[i].cmd))
+			return -1;
+
+	for (i = 0; i < config->nr_descriptors; i++)
+		if (check_descriptor(config, &config->descriptors[i]))
+			return -1;
+
+	for (i = 0; i < config->keymap_sz; i++)
+		if (check_descriptor(config, &config->keymap[i]))
+			return -1;
+
+	for (i = 0; i < config->chords_sz; i++)
+		if (config->chords[i].sz > ARRAY_SIZE(config->chords[i].keys) ||
+		    check_descriptor(config, &config->chords[i].d))
+			return -1;
+
+	return 0;
+}
+
+/*
+ * Loads the image corresponding to the given config file (see
+ * config_save_image()) without parsing it. The arrays of the resulting
+ * config point into a read-only mapping of the image, which is released
+ * by config_free().
+ *
+ * Returns:
+ * 	0 on success
+ * 	> 0 if the image is missing, stale or was produced by a different build
+ * 	< 0 if the image is corrupt
+ */
+int config_load_image(struct config *config, const char *path)
+{
+	int fd;
+	struct stat st;
+	char *image;
+	char *p;
+	struct image_header hdr;
+	char target[PATH_MAX+8];
+
+	image_path(path, target, sizeof target);
+
+	if ((fd = open(target, O_RDONLY | O_CLOEXEC)) < 0)
+		return 1;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof hdr) {
+		close(fd);
+		return -1;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (image == MAP_FAILED)
+		return -1;
+
+	memcpy(&hdr, image, sizeof hdr);
+
+	if (memcmp(hdr.magic, IMAGE_MAGIC, sizeof hdr.magic) ||
+	    hdr.version != IMAGE_VERSION ||
+	    hdr.config_sz != sizeof(struct config) ||
+	    hdr.descriptor_sz != sizeof(struct descriptor) ||
+	    hdr.chord_sz != sizeof(struct chord)) {
+		munmap(image, st.st_size);
+		return 1;
+	}
+
+	/* Bound the counts first so that image_size() cannot overflow. */
+	if (hdr.nr_sources > (uint64_t)st.st_size ||
+	    hdr.keymap_sz > (uint64_t)st.st_size ||
+	    hdr.chords_sz > (uint64_t)st.st_size ||
+	    hdr.macro_sz > (uint64_t)st.st_size ||
+	    image_size(&hdr) != (size_t)st.st_size) {
+		munmap(image, st.st_size);
+		return -1;
+	}
+
+	p = image + ALIGN(sizeof hdr);
+	memcpy(config, p, sizeof *config);
+	p += ALIGN(sizeof *config);
+
+	if (config->nr_sources != hdr.nr_sources ||
+	    config->keymap_sz != hdr.keymap_sz ||
+	    config->chords_sz != hdr.chords_sz) {
+		munmap(image, st.st_size);
+		return -1;
+	}
+
+	config->sources = (struct config_source *)p;
+	p += ALIGN(hdr.nr_sources * sizeof(struct config_source));
+
+	if (config_is_stale(config)) {
+		munmap(image, st.st_size);
+		return 1;
+	}
+
+	snprintf(config->path, sizeof config->path, "%s", path);
+
+	config->keymap = (struct descriptor *)p;
+	p += ALIGN(hdr.keymap_sz * sizeof(struct descriptor));
+
+	config->chords = (struct chord *)p;
+	p += ALIGN(hdr.chords_sz * sizeof(struct chord));
+
+	config->macro_arena.entries = (struct macro_entry *)p;
+	config->macro_arena.sz = hdr.macro_sz;
+	config->macro_arena.capacity = hdr.macro_sz;
+
+	if (check_config(config)) {
+		munmap(image, st.st_size);
+		return -1;
+	}
+
+	config_index_chords(config);
+
+	config->image = image;
+	config->image_sz = st.st_size;
+
+	return 0;
+}
+
+static int rc = 0;
+
+static void compile_config(const char *path)
+{
+	int ret;
+	struct config config;
+	char target[PATH_MAX+8];
+
+	keyd_log("Compiling b{%s}\n", path);
+
+	ret = config_parse(&config, path);
+	if (ret < 0) {
+		keyd_log("\tr{FAILED} (file does not exist?)\n");
+		rc = -1;
+		return;
+	} else if (ret > 0) {
+		rc = -1;
+	}
+
+	image_path(path, target, sizeof target);
+
+	if (config_save_image(&config, path) < 0) {
+		keyd_log("\tr{FAILED} %s\n", errstr);
+		rc = -1;
+	} else {
+		keyd_log("\twrote %s\n", target);
+	}
+
+	config_free(&config);
+}
+
+int compile(int argc, char *argv[])
+{
+	int i;
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			char path[PATH_MAX];
+
+			/* The daemon validates sources relative to its own working directory. */
+			if (!realpath(argv[i], path)) {
+				keyd_log("Compiling b{%s}\n\tr{FAILED} (file does not exist?)\n", argv[i]);
+				rc = -1;
+				continue;
+			}
+
+			compile_config(path);
+		}
+	} else {
+		DIR *dh;
+		struct dirent *ent;
+
+		dh = opendir(CONFIG_DIR);
+		if (!dh) {
+			perror("opendir");
+			return -1;
+		}
+
+		while ((ent = readdir(dh))) {
+			char path[PATH_MAX];
+
+			snprintf(path, sizeof path, "%s/%s", CONFIG_DIR, ent->d_name);
+
+			size_t len = strlen(path);
+			if (len > 5 && !strcmp(path + len - 5, ".conf"))
+				compile_config(path);
+		}
+		closedir(dh);
+	}
+
+	return rc;
+}
@@ -263,29 +263,106 @@ static char *read_config_file(const char *path, struct srcmap *srcmap)
 /* Return up to two keycodes associated with the given name. */
 static uint8_t lookup_keycode(const char *name)
 {
-	size_t i;
+	uint8_t code, shifted_code;
 
-	for (i = 0; i < 256; i++) {
-		const struct keycode_table_ent *ent = &keycode_table[i];
+	lookup_key_name(name, &code, &shifted_code);
+	return code;
+}
 
-		if (ent->name &&
-		    (!strcmp(ent->name, name) ||
-		     (ent->alt_name && !strcmp(ent->alt_name, name)))) {
-			return i;
+/* Makes room for an element at the given position of a heap allocated array. */
+static void *array_insert(void *arr, size_t *sz, size_t elemsz, size_t pos)
+{
+	arr = realloc(arr, (*sz + 1) * elemsz);
+	memmove((char *)arr + (pos + 1) * elemsz,
+		(char *)arr + pos * elemsz,
+		(*sz - pos) * elemsz);
+
+	(*sz)++;
+	return arr;
+}
+
+/* The position of the given code's entry within the layer's keymap. */
+static size_t keymap_rank(const struct layer *layer, uint8_t code)
+{
+	uint64_t below = ((uint64_t)1 << (code % 64)) - 1;
+
+	return layer->keymap_rank[code / 64] +
+		__builtin_popcountll(layer->keymap_mask[code / 64] & below);
+}
+
+/* Sets (or, if d is a noop, removes) the keymap entry for the given code. */
+static void layer_set_keymap(struct config *config, int idx,
+			     uint8_t code, const struct descriptor *d)
+{
+	size_t i;
+	int delta;
+	struct layer *layer = &config->layers[idx];
+	uint64_t bit = (uint64_t)1 << (code % 64);
+	size_t pos = layer->keymap_start + keymap_rank(layer, code);
+
+	if (layer->keymap_mask[code / 64] & bit) {
+		if (d->op) {
+			config->keymap[pos] = *d;
+			return;
 		}
+
+		memmove(&config->keymap[pos], &config->keymap[pos+1],
+			(config->keymap_sz - pos - 1) * sizeof config->keymap[0]);
+
+		config->keymap_sz--;
+		layer->keymap_mask[code / 64] &= ~bit;
+		delta = -1;
+	} else {
+		if (!d->op)
+			return;
+
+		config->keymap = array_insert(config->keymap, &config->keymap_sz,
+					      sizeof config->keymap[0], pos);
+		config->keymap[pos] = *d;
+
+		layer->keymap_mask[code / 64] |= bit;
+		delta = 1;
 	}
 
-	return 0;
+	for (i = code / 64 + 1; i < ARRAY_SIZE(layer->keymap_rank); i++)
+		layer->keymap_rank[i] += delta;
+
+	for (i = idx + 1; i < config->nr_layers; i++)
+		config->layers[i].keymap_start += delta;
 }
 
-static struct descriptor *layer_lookup_chord(struct layer *layer, uint8_t *keys, size_t n)
+/* Sets the nth chord of the given layer, appending it if n == nr_chords. */
+static void layer_set_chord(struct config *config, int idx,
+			    size_t n, const struct chord *chord)
 {
 	size_t i;
+	struct layer *layer = &config->layers[idx];
+	size_t pos = layer->chords_start + n;
+
+	if (n == layer->nr_chords) {
+		config->chords = array_insert(config->chords, &config->chords_sz,
+					      sizeof config->chords[0], pos);
+		layer->nr_chords++;
+
+		for (i = idx + 1; i < config->nr_layers; i++)
+			config->layers[i].chords_start++;
+	}
 
-	for (i = 0; i < layer->nr_chords; i++) {
+	config->chords[pos] = *chord;
+}
+
+/* Returns the index of the chord containing the given keys or -1. */
+static int layer_lookup_chord(const struct config *config,
+			      const struct config_overlay *overlay,
+			      int layer, uint8_t *keys, size_t n)
+{
+	size_t i;
+	size_t nr_chords = config_nr_chords(config, overlay, layer);
+
+	for (i = 0; i < nr_chords; i++) {
 		size_t j;
 		size_t nm = 0;
-		struct chord *chord = &layer->chords[i];
+		const struct chord *chord = config_get_chord(config, overlay, layer, i);
 
 		for (j = 0; j < n; j++) {
 			size_t k;
@@ -297,20 +374,69 @@ static struct descriptor *layer_lookup_chord(struct layer *layer, uint8_t *keys,
 		}
 
 		if (nm == n)
-			return &chord->d;
+			return i;
 	}
 
-	return NULL;
+	return -1;
+}
+
+static void overlay_set_chord(struct config_overlay *overlay, int layer,
+			      size_t idx, const struct chord *chord)
+{
+	size_t i;
+
+	for (i = 0; i < overlay->nr_chords; i++) {
+		if (overlay->chords[i].layer == layer && overlay->chords[i].idx == idx) {
+			overlay->chords[i].chord = *chord;
+			return;
+		}
+	}
+
+	overlay->chords = realloc(overlay->chords, (overlay->nr_chords+1) * sizeof overlay->chords[0]);
+	overlay->chords[overlay->nr_chords].layer = layer;
+	overlay->chords[overlay->nr_chords].idx = idx;
+	overlay->chords[overlay->nr_chords].chord = *chord;
+	overlay->nr_chords++;
+}
+
+static void overlay_bind(struct config_overlay *overlay, int layer,
+			 uint8_t code, const struct descriptor *d)
+{
+	size_t i;
+
+	overlay->bound[code / 64] |= (uint64_t)1 << (code % 64);
+
+	for (i = 0; i < overlay->nr_bindings; i++) {
+		if (overlay->bindings[i].layer == layer && overlay->bindings[i].code == code) {
+			overlay->bindings[i].d = *d;
+			return;
+		}
+	}
+
+	overlay->bindings = realloc(overlay->bindings, (overlay->nr_bindings+1) * sizeof overlay->bindings[0]);
+	overlay->bindings[overlay->nr_bindings].layer = layer;
+	overlay->bindings[overlay->nr_bindings].code = code;
+	overlay->bindings[overlay->nr_bindings].d = *d;
+	overlay->nr_bindings++;
+}
+
+static void set_keymap_entry(struct config *config, struct config_overlay *overlay,
+			     int layer, uint8_t code, const struct descriptor *d)
+{
+	if (overlay)
+		overlay_bind(overlay, layer, code, d);
+	else
+		layer_set_keymap(config, layer, code, d);
 }
 
 /*
  * Consumes a string of the form `[<layer>.]<key> = <descriptor>` and adds the
- * mapping to the corresponding layer in the config.
+ * mapping to the corresponding layer in the config (or the overlay, if one
+ * is supplied).
  */
 
-static int set_layer_entry(const struct config *config,
-			   struct layer *layer, char *key,
-			   const struct descriptor *d)
+static int set_layer_entry(struct config *config, struct config_overlay *overlay,
+			   int idx, char *key, const struct descriptor *d)
 {
 	size_t i;
 	int found = 0;
@@ -318,10 +444,12 @@ static int set_layer_entry(const struct config *config,
 	if (strchr(key, '+')) {
 		//TODO: Handle aliases
 		char *tok;
-		struct descriptor *ld;
-		uint8_t keys[ARRAY_SIZE(layer->chords[0].keys)];
-		size_t n = 0;
+		int n;
+		struct chord chord = {0};
+		uint8_t *keys = chord.keys;
+		size_t nr_chords = config_nr_chords(config, overlay, idx);
 
+		chord.sz = 0;
 		for (tok = strtok(key, "+"); tok; tok = strtok(NULL, "+")) {
 			uint8_t code = lookup_keycode(tok);
 			if (!code) {
@@ -329,35 +457,40 @@ static int set_layer_entry(const struct config *config,
 				return -1;
 			}
 
-			if (n >= ARRAY_SIZE(keys)) {
-				err("chords cannot contain more than %ld keys", n);
+			if (chord.sz >= ARRAY_SIZE(chord.keys)) {
+				err("chords cannot contain more than %ld keys", chord.sz);
 				return -1;
 			}
 
-			keys[n++] = code;
+			keys[chord.sz++] = code;
 		}
 
+		chord.d = *d;
 
-		if ((ld = layer_lookup_chord(layer, keys, n))) {
-			*ld = *d;
+		if ((n = layer_lookup_chord(config, overlay, idx, keys, chord.sz)) != -1) {
+			chord = *config_get_chord(config, overlay, idx, n);
+			chord.d = *d;
 		} else {
-			struct chord *chord;
-			if (layer->nr_chords >= ARRAY_SIZE(layer->chords)) {
-				err("max chords exceeded(%ld)", layer->nr_chords);
+			if (nr_chords >= MAX_CHORDS) {
+				err("max chords exceeded(%ld)", nr_chords);
 				return -1;
 			}
 
-			chord = &layer->chords[layer->nr_chords];
-			memcpy(chord->keys, keys, sizeof keys);
-			chord->sz = n;
-			chord->d = *d;
+			n = nr_chords;
+		}
 
-			layer->nr_chords++;
+		if (overlay) {
+			if ((size_t)n == nr_chords)
+				overlay->nr_layer_chords[idx]++;
+
+			overlay_set_chord(overlay, idx, n, &chord);
+		} else {
+			layer_set_chord(config, idx, n, &chord);
 		}
 	} else {
 		for (i = 0; i < 256; i++) {
 			if (!strcmp(config->aliases[i], key)) {
-				layer->keymap[i] = *d;
+				set_keymap_entry(config, overlay, idx, i, d);
 				found = 1;
 			}
 		}
@@ -370,7 +503,7 @@ static int set_layer_entry(const struct config *config,
 				return -1;
 			}
 
-			layer->keymap[code] = *d;
+			set_keymap_entry(config, overlay, idx, code, d);
 
 		}
 	}
@@ -389,8 +522,6 @@ static int new_layer(char *s, const struct config *config, struct layer *layer)
 
 	strcpy(layer->name, name);
 
-	layer->nr_chords = 0;
-
 	if (strchr(name, '+')) {
 		char *layername;
 		int n = 0;
@@ -447,6 +578,7 @@ static int config_add_layer(struct config *config, const char *s)
 	int ret;
 	char buf[MAX_LAYER_NAME_LEN+1];
 	char *name;
+	struct layer *layer;
 
 	if (strlen(s) >= sizeof buf) {
 		err("%s exceeds maximum section length (%d) (ignoring)", s, MAX_LAYER_NAME_LEN);
@@ -465,11 +597,18 @@ static int config_add_layer(struct config *config, const char *s)
 	}
 
 	strcpy(buf, s);
-	ret = new_layer(buf, config, &config->layers[config->nr_layers]);
+	layer = &config->layers[config->nr_layers];
+	ret = new_layer(buf, config, layer);
 
 	if (ret < 0)
 		return -1;
 
+	memset(layer->keymap_mask, 0, sizeof layer->keymap_mask);
+	memset(layer->keymap_rank, 0, sizeof layer->keymap_rank);
+	layer->keymap_start = config->keymap_sz;
+	layer->chords_start = config->chords_sz;
+	layer->nr_chords = 0;
+
 	config->nr_layers++;
 	return 0;
 }
@@ -548,8 +687,8 @@ exit:
 }
 
 /*
- * Parses macro expression placing the result
- * in the supplied macro struct.
+ * Parses macro expression appending the resulting
+ * entries to the supplied arena.
  *
  * Returns:
  *   0 on success
@@ -557,20 +696,10 @@ exit:
  *   > 0 for all other errors
  */
 
-int parse_macro_expression(const char *s, struct macro *macro)
+int parse_macro_expression(const char *s, struct macro_arena *arena)
 {
 	uint8_t code, mods;
 
-	#define ADD_ENTRY(t, d) do { \
-		if (macro->sz >= ARRAY_SIZE(macro->entries)) { \
-			err("maximum macro size (%d) exceeded", ARRAY_SIZE(macro->entries)); \
-			return 1; \
-		} \
-		macro->entries[macro->sz].type = t; \
-		macro->entries[macro->sz].data = d; \
-		macro->sz++; \
-	} while(0)
-
 	size_t len = strlen(s);
 
 	char buf[1024];
@@ -592,7 +721,7 @@ int parse_macro_expression(const char *s, struct macro *macro)
 		return -1;
 	}
 
-	return macro_parse(ptr, macro) == 0 ? 0 : 1;
+	return macro_parse(ptr, arena) == 0 ? 0 : 1;
 }
 
 static int parse_command(const char *s, struct command *command)
@@ -614,22 +743,107 @@ static int parse_command(const char *s, struct command *command)
 	return 0;
 }
 
+/*
+ * Append the given auxiliary entry to the config (or the overlay, if one is
+ * supplied) and return its index, or -1 if the corresponding table is full.
+ */
+
+static int add_command(struct config *config, struct config_overlay *overlay,
+		       const struct command *cmd)
+{
+	size_t n = config->nr_commands + (overlay ? overlay->nr_commands : 0);
+
+	if (n >= ARRAY_SIZE(config->commands)) {
+		err("max commands (%d), exceeded", ARRAY_SIZE(config->commands));
+		return -1;
+	}
+
+	if (overlay) {
+		overlay->commands = realloc(overlay->commands, (overlay->nr_commands+1) * sizeof overlay->commands[0]);
+		overlay->commands[overlay->nr_commands++] = *cmd;
+	} else {
+		config->commands[config->nr_commands++] = *cmd;
+	}
+
+	return n;
+}
+
+/*
+ * Like parse_macro_expression(), but additionally stores the macro in the
+ * config (or the overlay) and its index in idx.
+ */
+static int add_macro(struct config *config, struct config_overlay *overlay,
+		     const char *s, int16_t *idx)
+{
+	int ret;
+	struct macro_ref ref;
+	struct macro_arena *arena = overlay ? &overlay->macro_arena : &config->macro_arena;
+	size_t n = config->nr_macros + (overlay ? overlay->nr_macros : 0);
+
+	ref.off = arena->sz;
+	if ((ret = parse_macro_expression(s, arena)))
+		return ret;
+
+	ref.sz = arena->sz - ref.off;
+
+	if (n >= ARRAY_SIZE(config->macros)) {
+		err("max macros (%d), exceeded", ARRAY_SIZE(config->macros));
+		arena->sz = ref.off;
+		return 1;
+	}
+
+	if (overlay) {
+		overlay->macros = realloc(overlay->macros, (overlay->nr_macros+1) * sizeof overlay->macros[0]);
+		overlay->macros[overlay->nr_macros++] = ref;
+	} else {
+		config->macros[config->nr_macros++] = ref;
+	}
+
+	*idx = n;
+	return 0;
+}
+
+static int add_descriptor(struct config *config, struct config_overlay *overlay,
+			  const struct descriptor *d)
+{
+	size_t n = config->nr_descriptors + (overlay ? overlay->nr_descriptors : 0);
+
+	if (n >= ARRAY_SIZE(config->descriptors)) {
+		err("maximum descriptors exceeded");
+		return -1;
+	}
+
+	if (overlay) {
+		overlay->descriptors = realloc(overlay->descriptors, (overlay->nr_descriptors+1) * sizeof overlay->descriptors[0]);
+		overlay->descriptors[overlay->nr_descriptors++] = *d;
+	} else {
+		config->descriptors[config->nr_descriptors++] = *d;
+	}
+
+	return n;
+}
+
+/*
+ * Parses the given descriptor expression. Auxiliary entries are added to the
+ * overlay if one is supplied, in which case the config is left untouched.
+ */
 static int parse_descriptor(char *s,
 			    struct descriptor *d,
-			    struct config *config)
+			    struct config *config,
+			    struct config_overlay *overlay)
 {
 	char *fn = NULL;
 	char *args[5];
 	size_t nargs = 0;
 	uint8_t code, mods;
 	int ret;
-	struct macro macro;
 	struct command cmd;
 
-	if (!s || !s[0]) {
-		d->op = 0;
+	/* Keep unused arguments zeroed so that images are reproducible. */
+	memset(d, 0, sizeof *d);
+
+	if (!s || !s[0])
 		return 0;
-	}
 
 	if (!parse_key_sequence(s, &code, &mods)) {
 		size_t i;
@@ -663,32 +877,16 @@ static int parse_descriptor(char *s,
 			return -1;
 		}
 
-		if (config->nr_commands >= ARRAY_SIZE(config->commands)) {
-			err("max commands (%d), exceeded", ARRAY_SIZE(config->commands));
-			return -1;
-		}
-
-
 		d->op = OP_COMMAND;
-		d->args[0].idx = config->nr_commands;
-
-		config->commands[config->nr_commands++] = cmd;
+		if ((d->args[0].idx = add_command(config, overlay, &cmd)) < 0)
+			return -1;
 
 		return 0;
-	} else if ((ret=parse_macro_expression(s, &macro)) >= 0) {
+	} else if ((ret=add_macro(config, overlay, s, &d->args[0].idx)) >= 0) {
 		if (ret)
 			return -1;
 
-		if (config->nr_macros >= ARRAY_SIZE(config->macros)) {
-			err("max macros (%d), exceeded", ARRAY_SIZE(config->macros));
-			return -1;
-		}
-
 		d->op = OP_MACRO;
-		d->args[0].idx = config->nr_macros;
-
-		config->macros[config->nr_macros++] = macro;
-
 		return 0;
 	} else if (!parse_fn(s, &fn, args, &nargs)) {
 		int i;
@@ -761,21 +959,16 @@ static int parse_descriptor(char *s,
 						break;
 					case ARG_KEYSEQUENCE_DESCRIPTOR:
 					case ARG_DESCRIPTOR:
-						if (parse_descriptor(argstr, &desc, config))
+						if (parse_descriptor(argstr, &desc, config, overlay))
 							return -1;
 
-						if (config->nr_descriptors >= ARRAY_SIZE(config->descriptors)) {
-							err("maximum descriptors exceeded");
-							return -1;
-						}
-
 						if (type == ARG_KEYSEQUENCE_DESCRIPTOR && desc.op != OP_KEYSEQUENCE) {
 							err("%s is not a valid keysequence", argstr);
 							return -1;
 						}
 
-						config->descriptors[config->nr_descriptors] = desc;
-						arg->idx = config->nr_descriptors++;
+						if ((arg->idx = add_descriptor(config, overlay, &desc)) < 0)
+							return -1;
 						break;
 					case ARG_SENSITIVITY:
 						arg->sensitivity = atoi(argstr);
@@ -784,17 +977,8 @@ static int parse_descriptor(char *s,
 						arg->timeout = atoi(argstr);
 						break;
 					case ARG_MACRO:
-						if (config->nr_macros >= ARRAY_SIZE(config->macros)) {
-							err("max macros (%d), exceeded", ARRAY_SIZE(config->macros));
+						if (add_macro(config, overlay, argstr, &arg->idx))
 							return -1;
-						}
-
-						if (parse_macro_expression(argstr, &config->macros[config->nr_macros])) {
-							return -1;
-						}
-
-						arg->idx = config->nr_macros;
-						config->nr_macros++;
 
 						break;
 					default:
@@ -900,11 +1084,12 @@ static void parse_alias_section(struct config *config, struct ini_section *secti
 				uint8_t alias_code;
 
 				if ((alias_code = lookup_keycode(name))) {
-					struct descriptor *d = &config->layers[0].keymap[code];
+					struct descriptor d = {
+						.op = OP_KEYSEQUENCE,
+						.args[0].code = alias_code,
+					};
 
-					d->op = OP_KEYSEQUENCE;
-					d->args[0].code = alias_code;
-					d->args[1].mods = 0;
+					layer_set_keymap(config, 0, code, &d);
 				}
 
 				strcpy(config->aliases[code], name);
@@ -1040,8 +1225,30 @@ static void config_init(struct config *config)
  * 	n > 0 on partial success (where n is the number of issued warnings)
  * 	< 0 on complete failure
  */
+static void add_sources(struct config *config, const struct srcmap *srcmap)
+{
+	size_t i;
+
+	config->sources = calloc(srcmap->num_paths, sizeof config->sources[0]);
+
+	for (i = 0; i < srcmap->num_paths; i++) {
+		struct stat st;
+		struct config_source *src = &config->sources[config->nr_sources];
+
+		if (stat(srcmap->paths[i], &st))
+			continue;
+
+		snprintf(src->path, sizeof src->path, "%s", srcmap->paths[i]);
+		src->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		src->size = st.st_size;
+
+		config->nr_sources++;
+	}
+}
+
 int config_parse(struct config *config, const char *path)
 {
+	int ret;
 	char *content;
 	struct srcmap srcmap;
 
@@ -1050,7 +1257,75 @@ int config_parse(struct config *config, const char *path)
 
 	config_init(config);
 	snprintf(config->path, sizeof(config->path), "%s", path);
-	return do_parse(config, content, &srcmap);
+	add_sources(config, &srcmap);
+
+	ret = do_parse(config, content, &srcmap);
+	config_index_chords(config);
+
+	return ret;
+}
+
+/* Must be called once the chords of the config are final. */
+void config_index_chords(struct config *config)
+{
+	size_t i, j, k;
+
+	config->chord_index = NULL;
+
+	if (!config->chords_sz)
+		return;
+
+	config->chord_index = calloc(config->nr_layers, sizeof config->chord_index[0]);
+
+	for (i = 0; i < config->nr_layers; i++) {
+		const struct layer *layer = &config->layers[i];
+
+		for (j = 0; j < layer->nr_chords; j++) {
+			const struct chord *chord = &config->chords[layer->chords_start + j];
+
+			for (k = 0; k < chord->sz; k++)
+				config->chord_index[i][chord->keys[k]] |= (uint64_t)1 << j;
+		}
+	}
+}
+
+/* Returns 1 if any of the files the config was read from have changed since. */
+int config_is_stale(const struct config *config)
+{
+	size_t i;
+
+	for (i = 0; i < config->nr_sources; i++) {
+		struct stat st;
+		const struct config_source *src = &config->sources[i];
+
+		if (stat(src->path, &st) ||
+		    src->mtime != st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec ||
+		    src->size != st.st_size)
+			return 1;
+	}
+
+	return 0;
+}
+
+void config_free(struct config *config)
+{
+	if (config->image) {
+		munmap(config->image, config->image_sz);
+	} else {
+		free(config->keymap);
+		free(config->chords);
+		free(config->sources);
+		macro_arena_free(&config->macro_arena);
+	}
+
+	free(config->chord_index);
+
+	config->keymap = NULL;
+	config->chord_index = NULL;
+	config->chords = NULL;
+	config->sources = NULL;
+	config->macro_arena.entries = NULL;
+	config->image = NULL;
 }
 
 int config_check_match(struct config *config, const char *id, uint8_t flags)
@@ -1085,16 +1360,11 @@ int config_get_layer_index(const struct config *config, const char *name)
 	return -1;
 }
 
-/*
- * Adds a binding of the form [<layer>.]<key> = <descriptor expression>
- * to the given config.
- */
-int config_add_entry(struct config *config, const char *exp)
+static int add_entry(struct config *config, struct config_overlay *overlay, const char *exp)
 {
 	char *keyname, *descstr, *dot, *paren, *s;
 	char *layername = "main";
 	struct descriptor d;
-	struct layer *layer;
 	int idx;
 
 	static char buf[MAX_EXP_LEN];
@@ -1124,11 +1394,153 @@ int config_add_entry(struct config *config, const char *exp)
 		return -1;
 	}
 
-	layer = &config->layers[idx];
-
-	if (parse_descriptor(descstr, &d, config) < 0)
+	if (parse_descriptor(descstr, &d, config, overlay) < 0)
 		return -1;
 
-	return set_layer_entry(config, layer, keyname, &d);
+	return set_layer_entry(config, overlay, idx, keyname, &d);
+}
+
+/*
+ * Adds a binding of the form [<layer>.]<key> = <descriptor expression>
+ * to the given config.
+ */
+int config_add_entry(struct config *config, const char *exp)
+{
+	return add_entry(config, NULL, exp);
+}
+
+/*
+ * Like config_add_entry(), but records the binding in the supplied overlay
+ * instead of modifying the config.
+ */
+int config_add_binding(struct config *config, struct config_overlay *overlay, const char *exp)
+{
+	return add_entry(config, overlay, exp);
+}
+
+/* Discards all bindings (and their auxiliary entries) held by the overlay. */
+void config_overlay_reset(struct config_overlay *overlay)
+{
+	free(overlay->bindings);
+	free(overlay->chords);
+	free(overlay->descriptors);
+	free(overlay->macros);
+	free(overlay->commands);
+	macro_arena_free(&overlay->macro_arena);
+
+	memset(overlay, 0, sizeof *overlay);
+}
+
+const struct descriptor *config_get_keymap(const struct config *config,
+					   const struct config_overlay *overlay,
+					   int layer, uint8_t code)
+{
+	static const struct descriptor noop;
+
+	if (overlay && overlay->bound[code / 64] & ((uint64_t)1 << (code % 64))) {
+		size_t i;
+
+		for (i = 0; i < overlay->nr_bindings; i++) {
+			const struct binding *b = &overlay->bindings[i];
+
+			if (b->layer == layer && b->code == code)
+				return &b->d;
+		}
+	}
+
+	if (!(config->layers[layer].keymap_mask[code / 64] & ((uint64_t)1 << (code % 64))))
+		return &noop;
+
+	return &config->keymap[config->layers[layer].keymap_start +
+			       keymap_rank(&config->layers[layer], code)];
+}
+
+const struct chord *config_get_chord(const struct config *config,
+				     const struct config_overlay *overlay,
+				     int layer, size_t n)
+{
+	size_t i;
+
+	if (overlay) {
+		for (i = 0; i < overlay->nr_chords; i++) {
+			const struct overlay_chord *oc = &overlay->chords[i];
+
+			if (oc->layer == layer && oc->idx == n)
+				return &oc->chord;
+		}
+	}
+
+	assert(n < config->layers[layer].nr_chords);
+	return &config->chords[config->layers[layer].chords_start + n];
+}
+
+size_t config_nr_chords(const struct config *config,
+			const struct config_overlay *overlay, int layer)
+{
+	return config->layers[layer].nr_chords +
+		(overlay ? overlay->nr_layer_chords[layer] : 0);
+}
+
+/*
+ * The getters below tolerate indices which no longer exist, since keyboard
+ * state (e.g the descriptors of held keys) may outlive the overlay entries
+ * it refers to. Such indices resolve to a noop, an empty macro or NULL.
+ */
+const struct descriptor *config_get_descriptor(const struct config *config,
+					       const struct config_overlay *overlay,
+					       int idx)
+{
+	static const struct descriptor noop;
+
+	if (idx < 0)
+		return &noop;
+
+	if ((size_t)idx < config->nr_descriptors)
+		return &config->descriptors[idx];
+
+	if ((size_t)idx - config->nr_descriptors < overlay->nr_descriptors)
+		return &overlay->descriptors[idx - config->nr_descriptors];
+
+	return &noop;
+}
+
+struct macro config_get_macro(const struct config *config,
+			      const struct config_overlay *overlay,
+			      int idx)
+{
+	struct macro macro = {0};
+
+	if (idx < 0)
+		return macro;
+
+	if ((size_t)idx < config->nr_macros) {
+		const struct macro_ref *ref = &config->macros[idx];
+
+		macro.entries = config->macro_arena.entries + ref->off;
+		macro.sz = ref->sz;
+	} else if ((size_t)idx - config->nr_macros < overlay->nr_macros) {
+		const struct macro_ref *ref = &overlay->macros[idx - config->nr_macros];
+
+		macro.entries = overlay->macro_arena.entries + ref->off;
+		macro.sz = ref->sz;
+	}
+
+	return macro;
+}
+
+const struct command *config_get_command(const struct config *config,
+					 const struct config_overlay *overlay,
+					 int idx)
+{
+	if (idx < 0)
+		return NULL;
+
+	if ((size_t)idx < config->nr_commands)
+		return &config->commands[idx];
+
+	if ((size_t)idx - config->nr_commands < overlay->nr_commands)
+		return &overlay->commands[idx - config->nr_commands];
+
+	return NULL;
 }
 
@@ -13,6 +13,7 @@
 #define MAX_DESCRIPTOR_ARGS	3
 
 #define MAX_LAYERS		32
+#define MAX_CHORDS		64
 #define MAX_EXP_LEN		512
 
 
@@ -71,7 +72,7 @@ union descriptor_arg {
 /* Describes the intended purpose of a key (corresponds to an 'action' in user parlance). */
 
 struct descriptor {
-	enum op op;
+	uint8_t op; /* enum op */
 	union descriptor_arg args[MAX_DESCRIPTOR_ARGS];
 };
 
@@ -100,9 +101,19 @@ struct layer {
 	} type;
 
 	uint8_t mods;
-	struct descriptor keymap[256];
 
-	struct chord chords[64];
+	/*
+	 * The keymap is stored sparsely: keymap_mask records which codes
+	 * have an entry, the entries themselves are held (in code order)
+	 * in config->keymap from keymap_start onwards, and keymap_rank[i]
+	 * is the number of entries for codes below i*64.
+	 */
+	uint64_t keymap_mask[4];
+	uint16_t keymap_rank[4];
+	size_t keymap_start;
+
+	/* Likewise held in config->chords. */
+	size_t chords_start;
 	size_t nr_chords;
 
 	/* Used for composite layers. */
@@ -114,14 +125,47 @@ struct command {
 	char cmd[256];
 };
 
+/* A file a config was read from, used to detect stale images. */
+struct config_source {
+	char path[PATH_MAX];
+
+	int64_t mtime; /* In nanoseconds. */
+	int64_t size;
+};
+
+/* Identifies a macro by its position within a macro_arena. */
+struct macro_ref {
+	uint32_t off;
+	uint32_t sz;
+};
+
 struct config {
 	char path[PATH_MAX];
 	struct layer layers[MAX_LAYERS];
 
+	/*
+	 * The keymap entries and chords of all layers, laid out in layer
+	 * order (see struct layer).
+	 */
+	struct descriptor *keymap;
+	struct chord *chords;
+
+	size_t keymap_sz;
+	size_t chords_sz;
+
+	/*
+	 * For each layer and key, a bitmask of the layer's chords which
+	 * contain the key. Built once the config is complete, NULL if
+	 * there are no chords.
+	 */
+	uint64_t (*chord_index)[256];
+
 	/* Auxiliary descriptors used by layer bindings. */
 	struct descriptor descriptors[1024];
-	struct macro macros[256];
+	struct macro_ref macros[256];
 	struct command commands[64];
+
+	struct macro_arena macro_arena;
 	char aliases[256][32];
 
 	uint8_t wildcard;
@@ -151,12 +195,88 @@ struct config {
 	uint8_t layer_indicator;
 	uint8_t disable_modifier_guard;
 	char default_layout[MAX_LAYER_NAME_LEN];
+
+	/* The config file followed by any files it includes. */
+	struct config_source *sources;
+	size_t nr_sources;
+
+	/*
+	 * If the config was loaded from an image, the mapping which the
+	 * arrays above point into.
+	 */
+	void *image;
+	size_t image_sz;
+};
+
+/*
+ * Bindings added at runtime (e.g by `keyd bind`) on top of a config which is
+ * shared between keyboards and never modified. Auxiliary entries created by
+ * the bindings are indexed after those of the config, and new chords are
+ * numbered after the existing ones in their layer.
+ */
+struct config_overlay {
+	struct binding {
+		uint8_t layer;
+		uint8_t code;
+		struct descriptor d;
+	} *bindings;
+	size_t nr_bindings;
+
+	/* Codes with at least one binding. */
+	uint64_t bound[4];
+
+	struct overlay_chord {
+		uint8_t layer;
+		size_t idx;
+		struct chord chord;
+	} *chords;
+	size_t nr_chords;
+
+	/* The number of chords appended to each layer. */
+	size_t nr_layer_chords[MAX_LAYERS];
+
+	struct descriptor *descriptors;
+	struct macro_ref *macros;
+	struct command *commands;
+
+	struct macro_arena macro_arena;
+
+	size_t nr_descriptors;
+	size_t nr_macros;
+	size_t nr_commands;
 };
 
 int config_parse(struct config *config, const char *path);
+void config_free(struct config *config);
+int config_is_stale(const struct config *config);
+void config_index_chords(struct config *config);
+
+int config_save_image(const struct config *config, const char *path);
+int config_load_image(struct config *config, const char *path);
 int config_add_entry(struct config *config, const char *exp);
+int config_add_binding(struct config *config, struct config_overlay *overlay, const char *exp);
+void config_overlay_reset(struct config_overlay *overlay);
 int config_get_layer_index(const struct config *config, const char *name);
 
 int config_check_match(struct config *config, const char *id, uint8_t flags);
 
+const struct descriptor *config_get_keymap(const struct config *config,
+					   const struct config_overlay *overlay,
+					   int layer, uint8_t code);
+const struct chord *config_get_chord(const struct config *config,
+				     const struct config_overlay *overlay,
+				     int layer, size_t n);
+size_t config_nr_chords(const struct config *config,
+			const struct config_overlay *overlay, int layer);
+
+const struct descriptor *config_get_descriptor(const struct config *config,
+					       const struct config_overlay *overlay,
+					       int idx);
+struct macro config_get_macro(const struct config *config,
+			      const struct config_overlay *overlay,
+			      int idx);
+const struct command *config_get_command(const struct config *config,
+					 const struct config_overlay *overlay,
+					 int idx);
+
 #endif
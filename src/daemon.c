@@ -1,29 +1,113 @@
 #include "keyd.h"
 
+#include <sys/inotify.h>
+
+/* How long to wait for a burst of config file changes to settle (in microseconds). */
+#define RELOAD_DELAY 100000
+
 struct config_ent {
 	struct config config;
 	struct keyboard *kbd;
 	struct config_ent *next;
+
+	/* The time at which the keyboard timer expires (0 if unarmed). */
+	uint64_t timeout;
 };
 
 static int ipcfd = -1;
 static struct vkbd *vkbd = NULL;
 static struct config_ent *configs;
 
-static uint8_t keystate[256];
+/* Signals changes to CONFIG_DIR or any of the files included by a config. */
+static int watchfd = -1;
+
+/* The time at which a pending (debounced) reload is due (0 if none). */
+static uint64_t reload_time = 0;
+
+/* Output produced on behalf of IPC clients (e.g keyd do/input). */
+static struct macro_queue ipc_queue;
+
+/* The timestamp of the event currently being handled. */
+static uint64_t current_time;
+
+/*
+ * IPC connections whose request has not been fully received yet, in the
+ * order in which they were accepted. Requests are read incrementally as
+ * data arrives, so a slow client cannot stall the event loop.
+ */
+static struct client {
+	int fd;
+	size_t sz;
+	struct ipc_message msg;
+} clients[16];
+
+static size_t nr_clients = 0;
+
+/*
+ * Layer changes are appended to a ring buffer from which each listener is
+ * fed at its own pace using non-blocking writes. A listener which falls
+ * more than a buffer's worth behind skips the missed events (after
+ * completing the line it was in the middle of) and is sent a snapshot of
+ * the current layer state instead.
+ */
+#define LAYER_EVENT_BUFSZ 16384
+
+static char layer_events[LAYER_EVENT_BUFSZ];
+
+/* The total number of bytes ever appended to layer_events. */
+static uint64_t layer_events_end = 0;
+
+static struct listener {
+	int fd;
+
+	/* The position (in the layer_events stream) of the next byte to be sent. */
+	uint64_t cursor;
+
+	/* Sent before any events, NULL if there is nothing to send. */
+	char *snapshot;
+	size_t snapshot_sz;
+	size_t snapshot_off;
+
+	/* Set while waiting for the socket to become writable. */
+	int blocked;
+
+	/* Set if the last byte sent was not the end of a line. */
+	int partial;
+} *listeners;
 
-static int listeners[32];
 static size_t nr_listeners = 0;
+static size_t listeners_sz = 0;
 static struct keyboard *active_kbd = NULL;
 
+/*
+ * Key events belonging to the current (incomplete) input frame. These are
+ * accumulated until the kernel signals the end of the frame (DEV_SYN) and then
+ * passed to the keyboard as a single batch.
+ */
+static struct {
+	struct device *dev;
+	struct keyboard *kbd;
+
+	struct key_event events[MAX_FRAME_EVENTS];
+	size_t sz;
+} frame;
+
+static void free_config_ent(struct config_ent *ent)
+{
+	config_overlay_reset(&ent->kbd->overlay);
+	macro_queue_free(&ent->kbd->macro_queue);
+	free(ent->kbd);
+	config_free(&ent->config);
+	free(ent);
+}
+
 static void free_configs(void)
 {
 	struct config_ent *ent = configs;
 	while (ent) {
 		struct config_ent *tmp = ent;
 		ent = ent->next;
-		free(tmp->kbd);
-		free(tmp);
+		free_config_ent(tmp);
 	}
 
 	configs = NULL;
@@ -32,24 +116,12 @@ static void free_configs(void)
 static void cleanup(void)
 {
 	free_configs();
+	macro_queue_free(&ipc_queue);
 	free_vkbd(vkbd);
 }
 
-static void clear_vkbd(void)
-{
-	size_t i;
-
-	for (i = 0; i < 256; i++)
-		if (keystate[i]) {
-			vkbd_send_key(vkbd, i, 0);
-			keystate[i] = 0;
-		}
-}
-
 static void send_key(uint8_t code, uint8_t state)
 {
-	keystate[code] = state;
-
 	switch (code) {
 		case KEYD_SCROLL_DOWN:
 			if (state)
@@ -73,84 +145,251 @@ static void send_key(uint8_t code, uint8_t state)
 	}
 }
 
-static void send_key_macro_wrapper(void *ctx, uint8_t code, uint8_t state)
+static void send_key_wrapper(void *ctx, uint8_t code, uint8_t state)
 {
 	send_key(code, state);
 }
 
-static void add_listener(int con)
+static void ipc_send_key(void *ctx, uint8_t code, uint8_t state)
 {
-	struct timeval tv;
+	macro_queue_output(&ipc_queue, code, state, send_key_wrapper, NULL);
+}
 
-	/*
-	 * In order to avoid blocking the main event loop, allow up to 50ms for
-	 * slow clients to relieve back pressure before dropping them.
-	 */
-	tv.tv_usec = 50000;
-	tv.tv_sec = 0;
+static void ipc_delay(void *ctx, long usec)
+{
+	macro_queue_delay(&ipc_queue, current_time, usec);
+}
 
-	if (nr_listeners == ARRAY_SIZE(listeners)) {
-		char s[] = "Max listeners exceeded\n";
-		xwrite(con, &s, sizeof s);
+static void set_timeout(const struct keyboard *kbd, uint64_t time)
+{
+	struct config_ent *ent;
 
-		close(con);
-		return;
-	}
+	for (ent = configs; ent; ent = ent->next)
+		if (ent->kbd == kbd)
+			ent->timeout = time;
+}
 
-	setsockopt(con, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+static void set_nonblocking(int fd, int nonblocking)
+{
+	int flags = fcntl(fd, F_GETFL);
 
-	if (active_kbd) {
-		size_t i;
-		struct config *config = &active_kbd->config;
-		struct layer *layout = &config->layers[0];
+	if (flags < 0 || fcntl(fd, F_SETFL, nonblocking ?
+			       flags | O_NONBLOCK : flags & ~O_NONBLOCK) < 0) {
+		perror("fcntl");
+		exit(-1);
+	}
+}
 
-		for (i = 1; i < config->nr_layers; i++)
-			if (active_kbd->layer_state[i].active) {
-				struct layer *layer = &config->layers[i];
+/*
+ * Describes the layer state of the given keyboard. If full is set, inactive
+ * layers are explicitly listed so that clients which missed events can
+ * resynchronize their state.
+ */
+static char *layer_snapshot(const struct keyboard *kbd, int full, size_t *sz)
+{
+	size_t i;
+	char *buf = NULL;
+	FILE *fh = open_memstream(&buf, sz);
+	const struct config *config = kbd->config;
+	const struct layer *layout = &config->layers[0];
 
-				if (layer->type == LT_LAYOUT) {
-					layout = layer;
-					break;
-				}
+	for (i = 1; i < config->nr_layers; i++)
+		if (kbd->layer_state[i].active) {
+			const struct layer *layer = &config->layers[i];
+
+			if (layer->type == LT_LAYOUT) {
+				layout = layer;
+				break;
 			}
+		}
 
-		dprintf(con, "/%s\n", layout->name);
+	fprintf(fh, "/%s\n", layout->name);
 
-		for (i = 1; i < config->nr_layers; i++) {
-			if (active_kbd->layer_state[i].active) {
-				ssize_t ret;
-				struct layer *layer = &config->layers[i];
+	for (i = 1; i < config->nr_layers; i++) {
+		const struct layer *layer = &config->layers[i];
 
-				if (layer->type != LT_LAYOUT) {
-					ret = dprintf(con, "+%s\n", layer->name);
-					if (ret < 0)
-						goto fail;
-				}
-			}
+		if (layer->type == LT_LAYOUT)
+			continue;
+
+		if (kbd->layer_state[i].active)
+			fprintf(fh, "+%s\n", layer->name);
+		else if (full)
+			fprintf(fh, "-%s\n", layer->name);
+	}
+
+	fclose(fh);
+	return buf;
+}
+
+static void drop_listener(size_t idx)
+{
+	struct listener *listener = &listeners[idx];
+
+	if (listener->blocked)
+		evloop_remove_fd(listener->fd);
+
+	close(listener->fd);
+	free(listener->snapshot);
+
+	listeners[idx] = listeners[--nr_listeners];
+}
+
+/* Returns -1 if the listener has gone away. */
+static int write_listener(struct listener *listener)
+{
+	ssize_t n = 0;
+	int blocked = 0;
+
+	while (listener->snapshot) {
+		n = write(listener->fd,
+			  listener->snapshot + listener->snapshot_off,
+			  listener->snapshot_sz - listener->snapshot_off);
+
+		if (n < 0)
+			goto out;
+
+		if (n)
+			listener->partial = listener->snapshot[listener->snapshot_off + n - 1] != '\n';
+
+		listener->snapshot_off += n;
+
+		if (listener->snapshot_off == listener->snapshot_sz) {
+			free(listener->snapshot);
+			listener->snapshot = NULL;
 		}
 	}
 
-	listeners[nr_listeners++] = con;
-	return;
-fail:
-	close(con);
-	return;
+	while (listener->cursor != layer_events_end) {
+		size_t off = listener->cursor % LAYER_EVENT_BUFSZ;
+		size_t sz = layer_events_end - listener->cursor;
+
+		if (sz > LAYER_EVENT_BUFSZ - off)
+			sz = LAYER_EVENT_BUFSZ - off;
+
+		n = write(listener->fd, layer_events + off, sz);
+
+		if (n < 0)
+			goto out;
+
+		if (n)
+			listener->partial = layer_events[off + n - 1] != '\n';
+
+		listener->cursor += n;
+	}
+
+out:
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		blocked = 1;
+	}
+
+	if (blocked && !listener->blocked)
+		evloop_add_output_fd(listener->fd);
+	else if (!blocked && listener->blocked)
+		evloop_remove_fd(listener->fd);
+
+	listener->blocked = blocked;
+	return 0;
 }
 
-static void on_layer_change(const struct keyboard *kbd, const struct layer *layer, uint8_t state)
+static void add_listener(int con)
+{
+	struct listener *listener;
+
+	set_nonblocking(con, 1);
+
+	if (nr_listeners == listeners_sz) {
+		listeners_sz = listeners_sz ? listeners_sz * 2 : 16;
+		listeners = realloc(listeners, listeners_sz * sizeof listeners[0]);
+	}
+
+	listener = &listeners[nr_listeners++];
+
+	listener->fd = con;
+	listener->cursor = layer_events_end;
+	listener->snapshot = NULL;
+	listener->blocked = 0;
+	listener->partial = 0;
+
+	if (active_kbd) {
+		listener->snapshot = layer_snapshot(active_kbd, 0, &listener->snapshot_sz);
+		listener->snapshot_off = 0;
+	}
+
+	if (write_listener(listener) < 0)
+		drop_listener(nr_listeners-1);
+}
+
+/* Returns 0 if fd does not belong to a listener. */
+static int handle_listener(int fd, int error)
 {
 	size_t i;
-	char buf[MAX_LAYER_NAME_LEN+2];
-	ssize_t bufsz;
 
-	int keep[ARRAY_SIZE(listeners)];
+	for (i = 0; i < nr_listeners; i++)
+		if (listeners[i].fd == fd) {
+			if (error || write_listener(&listeners[i]) < 0)
+				drop_listener(i);
+
+			return 1;
+		}
+
+	return 0;
+}
+
+/*
+ * Replaces the backlog of a listener which has fallen too far behind with a
+ * full snapshot, resuming it from the given position. A partially sent line
+ * is completed first so that clients never observe a truncated line, this
+ * must consequently happen before the unsent events are overwritten.
+ */
+static void resync_listener(struct listener *listener, const struct keyboard *kbd, uint64_t cursor)
+{
+	char line[MAX_LAYER_NAME_LEN+2];
 	size_t n = 0;
+	char *snapshot;
+	size_t sz;
+
+	while (listener->partial && n < sizeof line) {
+		char c;
+
+		if (listener->snapshot)
+			c = listener->snapshot[listener->snapshot_off + n];
+		else
+			c = layer_events[(listener->cursor + n) % LAYER_EVENT_BUFSZ];
+
+		line[n++] = c;
+		if (c == '\n')
+			break;
+	}
 
-	if (kbd->config.layer_indicator) {
+	snapshot = layer_snapshot(kbd, 1, &sz);
+
+	free(listener->snapshot);
+	listener->snapshot = malloc(n + sz);
+	listener->snapshot_sz = n + sz;
+	listener->snapshot_off = 0;
+
+	memcpy(listener->snapshot, line, n);
+	memcpy(listener->snapshot + n, snapshot, sz);
+	free(snapshot);
+
+	listener->cursor = cursor;
+}
+
+static void on_layer_change(const struct keyboard *kbd, const struct layer *layer, uint8_t state)
+{
+	size_t i;
+	char buf[MAX_LAYER_NAME_LEN+2];
+	size_t bufsz;
+	size_t off;
+
+	if (kbd->config->layer_indicator) {
 		int active_layers = 0;
 
-		for (i = 1; i < kbd->config.nr_layers; i++)
-			if (kbd->config.layers[i].type != LT_LAYOUT && kbd->layer_state[i].active) {
+		for (i = 1; i < kbd->config->nr_layers; i++)
+			if (kbd->config->layers[i].type != LT_LAYOUT && kbd->layer_state[i].active) {
 				active_layers = 1;
 				break;
 			}
@@ -168,25 +407,93 @@ static void on_layer_change(const struct keyboard *kbd, const struct layer *laye
 	else
 		bufsz = snprintf(buf, sizeof(buf), "%c%s\n", state ? '+' : '-', layer->name);
 
-	for (i = 0; i < nr_listeners; i++) {
-		ssize_t nw = write(listeners[i], buf, bufsz);
+	/*
+	 * The snapshot reflects the current state (which already includes the
+	 * change), so lagging listeners resume after the new event.
+	 */
+	for (i = 0; i < nr_listeners; i++)
+		if (layer_events_end + bufsz - listeners[i].cursor > LAYER_EVENT_BUFSZ)
+			resync_listener(&listeners[i], kbd, layer_events_end + bufsz);
 
-		if (nw == bufsz)
-			keep[n++] = listeners[i];
-		else
-			close(listeners[i]);
+	off = layer_events_end % LAYER_EVENT_BUFSZ;
+
+	if (bufsz > LAYER_EVENT_BUFSZ - off) {
+		memcpy(layer_events + off, buf, LAYER_EVENT_BUFSZ - off);
+		memcpy(layer_events, buf + LAYER_EVENT_BUFSZ - off, bufsz - (LAYER_EVENT_BUFSZ - off));
+	} else {
+		memcpy(layer_events + off, buf, bufsz);
+	}
+
+	layer_events_end += bufsz;
+
+	i = nr_listeners;
+	while (i--) {
+		struct listener *listener = &listeners[i];
+
+		/* Blocked listeners are resumed from the event loop. */
+		if (!listener->blocked && write_listener(listener) < 0)
+			drop_listener(i);
+	}
+}
+
+static struct config_ent *load_config(const char *path)
+{
+	int ret;
+	struct config_ent *ent = calloc(1, sizeof(struct config_ent));
+	struct output output = {
+		.send_key = send_key,
+		.on_layer_change = on_layer_change,
+		.set_timeout = set_timeout,
+	};
+
+	if (!(ret = config_load_image(&ent->config, path))) {
+		keyd_log("CONFIG: loaded b{%s} (compiled)\n", path);
+	} else {
+		if (ret < 0)
+			keyd_log("CONFIG: y{WARNING} ignoring corrupt image for %s\n", path);
+
+		keyd_log("CONFIG: parsing b{%s}\n", path);
+		ret = config_parse(&ent->config, path);
 	}
 
-	if (n != nr_listeners) {
-		nr_listeners = n;
-		memcpy(listeners, keep, n * sizeof(int));
+	if (ret < 0) {
+		free(ent);
+		keyd_log("DEVICE: y{WARNING} failed to parse %s\n", path);
+		return NULL;
 	}
+
+	ent->kbd = new_keyboard(&ent->config, &output);
+	return ent;
+}
+
+/* Removes the entry for the given config file from the list and returns it. */
+static struct config_ent *take_config_ent(struct config_ent **list, const char *path)
+{
+	struct config_ent **ent;
+
+	for (ent = list; *ent; ent = &(*ent)->next)
+		if (!strcmp((*ent)->config.path, path)) {
+			struct config_ent *match = *ent;
+
+			*ent = match->next;
+			match->next = NULL;
+			return match;
+		}
+
+	return NULL;
 }
 
-static void load_configs(void)
+/*
+ * Brings the loaded configs in line with the contents of CONFIG_DIR. Unless
+ * full is set, configs whose files (including any included files) are
+ * unchanged are kept along with the state of their keyboards. Entries which
+ * have been superseded or whose files no longer exist are moved to *retired.
+ */
+static void load_configs(int full, struct config_ent **retired)
 {
 	DIR *dh = opendir(CONFIG_DIR);
 	struct dirent *dirent;
+	struct config_ent *old = configs;
 
 	if (!dh) {
 		perror("opendir");
@@ -205,27 +512,34 @@ static void load_configs(void)
 		len = snprintf(path, sizeof path, "%s/%s", CONFIG_DIR, dirent->d_name);
 
 		if (len >= 5 && !strcmp(path + len - 5, ".conf")) {
-			struct config_ent *ent = calloc(1, sizeof(struct config_ent));
+			struct config_ent *ent = take_config_ent(&old, path);
 
-			keyd_log("CONFIG: parsing b{%s}\n", path);
+			if (ent && (full || config_is_stale(&ent->config))) {
+				ent->next = *retired;
+				*retired = ent;
+				ent = NULL;
+			}
 
-			if (config_parse(&ent->config, path) >= 0) {
-				struct output output = {
-					.send_key = send_key,
-					.on_layer_change = on_layer_change,
-				};
-				ent->kbd = new_keyboard(&ent->config, &output);
+			if (!ent)
+				ent = load_config(path);
 
+			if (ent) {
 				ent->next = configs;
 				configs = ent;
-			} else {
-				free(ent);
-				keyd_log("DEVICE: y{WARNING} failed to parse %s\n", path);
 			}
-
 		}
 	}
 
+	while (old) {
+		struct config_ent *ent = old;
+
+		old = old->next;
+		keyd_log("CONFIG: removed b{%s}\n", ent->config.path);
+
+		ent->next = *retired;
+		*retired = ent;
+	}
+
 	closedir(dh);
 }
 
@@ -257,13 +571,9 @@ static struct config_ent *lookup_config_ent(const char *id, uint8_t flags)
 	}
 }
 
-static void manage_device(struct device *dev)
+static struct config_ent *lookup_device_config(struct device *dev)
 {
 	uint8_t flags = 0;
-	struct config_ent *ent;
-
-	if (dev->is_virtual)
-		return;
 
 	if (dev->capabilities & CAP_KEY)
 		flags |= ID_KEY;
@@ -274,7 +584,12 @@ static void manage_device(struct device *dev)
 	if (dev->capabilities & CAP_MOUSE)
 		flags |= ID_MOUSE;
 
-	if ((ent = lookup_config_ent(dev->id, flags))) {
+	return lookup_config_ent(dev->id, flags);
+}
+
+static void assign_device(struct device *dev, struct config_ent *ent)
+{
+	if (ent) {
 		if (device_grab(dev)) {
 			keyd_log("DEVICE: y{WARNING} Failed to grab %s\n", dev->path);
 			dev->data = NULL;
@@ -292,17 +607,118 @@ static void manage_device(struct device *dev)
 	}
 }
 
-static void reload(void)
+static void manage_device(struct device *dev)
+{
+	if (dev->is_virtual)
+		return;
+
+	assign_device(dev, lookup_device_config(dev));
+}
+
+/*
+ * Watches CONFIG_DIR and the directories of all included files. Directories
+ * (rather than files) are watched so that editors which replace files
+ * on save are handled.
+ */
+static void watch_configs(void)
+{
+	struct config_ent *ent;
+	const uint32_t mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+			      IN_MOVED_TO | IN_MOVED_FROM;
+
+	if (watchfd == -1) {
+		watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (watchfd < 0) {
+			perror("inotify_init1");
+			return;
+		}
+
+		evloop_add_fd(watchfd);
+	}
+
+	inotify_add_watch(watchfd, CONFIG_DIR, mask);
+
+	for (ent = configs; ent; ent = ent->next) {
+		size_t i;
+
+		for (i = 0; i < ent->config.nr_sources; i++) {
+			char dir[PATH_MAX];
+			char *sep;
+
+			snprintf(dir, sizeof dir, "%s", ent->config.sources[i].path);
+			if ((sep = strrchr(dir, '/')) && sep != dir) {
+				*sep = 0;
+				inotify_add_watch(watchfd, dir, mask);
+			}
+		}
+	}
+}
+
+/* Drains pending change notifications and schedules a reload. */
+static void handle_watch(uint64_t time)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (read(watchfd, buf, sizeof buf) > 0)
+		;
+
+	reload_time = time + RELOAD_DELAY;
+}
+
+/*
+ * Reparses the configs whose files have changed (or all of them if full is
+ * set) and rematches devices against the result. Keyboards whose config is
+ * unchanged (and devices which remain attached to them) are left untouched,
+ * so that held keys, active layers and runtime bindings survive unrelated
+ * edits. Any output held by a discarded keyboard is released.
+ */
+static void reload(int full)
 {
 	size_t i;
+	struct config_ent *retired = NULL;
 
-	free_configs();
-	load_configs();
+	reload_time = 0;
+	load_configs(full, &retired);
+
+	for (i = 0; i < device_table_sz; i++) {
+		struct device *dev = &device_table[i];
+		struct config_ent *ent;
+
+		if (dev->is_virtual)
+			continue;
+
+		ent = lookup_device_config(dev);
+		if ((ent ? ent->kbd : NULL) != dev->data)
+			assign_device(dev, ent);
+	}
+
+	while (retired) {
+		struct config_ent *ent = retired;
+
+		retired = retired->next;
 
-	for (i = 0; i < device_table_sz; i++)
-		manage_device(&device_table[i]);
+		if (active_kbd == ent->kbd)
+			active_kbd = NULL;
 
-	clear_vkbd();
+		kbd_reset(ent->kbd);
+		free_config_ent(ent);
+	}
+
+	watch_configs();
+	vkbd_flush(vkbd);
+}
+
+/*
+ * Replies are written without blocking. The reply is the first (and only)
+ * thing written to the connection, so it fits into the empty socket buffer
+ * unless the client is misbehaving, in which case it is dropped.
+ */
+static void send_reply(int con, const struct ipc_message *msg)
+{
+	if (write(con, msg, sizeof *msg) != sizeof *msg)
+		keyd_log("IPC: y{WARNING} dropped reply to an unresponsive client\n");
+
+	close(con);
 }
 
 static void send_success(int con)
@@ -312,8 +728,7 @@ static void send_success(int con)
 	msg.type = IPC_SUCCESS;;
 	msg.sz = 0;
 
-	xwrite(con, &msg, sizeof msg);
-	close(con);
+	send_reply(con, &msg);
 }
 
 static void send_fail(int con, const char *fmt, ...)
@@ -325,16 +740,14 @@ static void send_fail(int con, const char *fmt, ...)
 
 	msg.type = IPC_FAIL;
 	msg.sz = vsnprintf(msg.data, sizeof(msg.data), fmt, args);
-
-	xwrite(con, &msg, sizeof msg);
-	close(con);
-
 	va_end(args);
+
+	send_reply(con, &msg);
 }
 
 static int input(char *buf, size_t sz, uint32_t timeout)
 {
-	size_t i;
+	size_t i, n;
 	uint32_t codepoint;
 	uint8_t codes[4];
 
@@ -342,33 +755,30 @@ static int input(char *buf, size_t sz, uint32_t timeout)
 
 	while ((csz = utf8_read_char(buf, &codepoint))) {
 		int found = 0;
-		char s[2];
 
 		if (csz == 1) {
 			uint8_t code, mods;
-			s[0] = (char)codepoint;
-			s[1] = 0;
 
 			found = 1;
-			if (!parse_key_sequence(s, &code, &mods)) {
+			if (!lookup_char(codepoint, &code, &mods)) {
 				if (mods & MOD_SHIFT) {
-					vkbd_send_key(vkbd, KEYD_LEFTSHIFT, 1);
-					vkbd_send_key(vkbd, code, 1);
-					vkbd_send_key(vkbd, code, 0);
-					vkbd_send_key(vkbd, KEYD_LEFTSHIFT, 0);
+					ipc_send_key(NULL, KEYD_LEFTSHIFT, 1);
+					ipc_send_key(NULL, code, 1);
+					ipc_send_key(NULL, code, 0);
+					ipc_send_key(NULL, KEYD_LEFTSHIFT, 0);
 				} else {
-					vkbd_send_key(vkbd, code, 1);
-					vkbd_send_key(vkbd, code, 0);
+					ipc_send_key(NULL, code, 1);
+					ipc_send_key(NULL, code, 0);
 				}
 			} else if ((char)codepoint == ' ') {
-				vkbd_send_key(vkbd, KEYD_SPACE, 1);
-				vkbd_send_key(vkbd, KEYD_SPACE, 0);
+				ipc_send_key(NULL, KEYD_SPACE, 1);
+				ipc_send_key(NULL, KEYD_SPACE, 0);
 			} else if ((char)codepoint == '\n') {
-				vkbd_send_key(vkbd, KEYD_ENTER, 1);
-				vkbd_send_key(vkbd, KEYD_ENTER, 0);
+				ipc_send_key(NULL, KEYD_ENTER, 1);
+				ipc_send_key(NULL, KEYD_ENTER, 0);
 			} else if ((char)codepoint == '\t') {
-				vkbd_send_key(vkbd, KEYD_TAB, 1);
-				vkbd_send_key(vkbd, KEYD_TAB, 0);
+				ipc_send_key(NULL, KEYD_TAB, 1);
+				ipc_send_key(NULL, KEYD_TAB, 0);
 			} else {
 				found = 0;
 			}
@@ -381,65 +791,67 @@ static int input(char *buf, size_t sz, uint32_t timeout)
 				return -1;
 			}
 
-			unicode_get_sequence(idx, codes);
+			n = unicode_get_sequence(idx, codes);
 
-			for (i = 0; i < 4; i++) {
-				vkbd_send_key(vkbd, codes[i], 1);
-				vkbd_send_key(vkbd, codes[i], 0);
+			for (i = 0; i < n; i++) {
+				ipc_send_key(NULL, codes[i], 1);
+				ipc_send_key(NULL, codes[i], 0);
 			}
 		}
 		buf+=csz;
 
 		if (timeout)
-			usleep(timeout);
+			ipc_delay(NULL, timeout);
 	}
 
 	return 0;
 }
 
-static void handle_client(int con)
+static void handle_request(int con, struct ipc_message *msg)
 {
-	struct ipc_message msg;
-
-	xread(con, &msg, sizeof msg);
-
-	if (msg.sz >= sizeof(msg.data)) {
+	if (msg->sz >= sizeof(msg->data)) {
 		send_fail(con, "maximum message size exceeded");
 		return;
 	}
-	msg.data[msg.sz] = 0;
+	msg->data[msg->sz] = 0;
 
-	if (msg.timeout > 1000000) {
+	if (msg->timeout > 1000000) {
 		send_fail(con, "timeout cannot exceed 1000 ms");
 		return;
 	}
 
-	switch (msg.type) {
+	switch (msg->type) {
 		struct config_ent *ent;
 		int success;
 		struct macro macro;
+		struct macro_arena arena;
 
 	case IPC_MACRO:
-		while (msg.sz && msg.data[msg.sz-1] == '\n')
-			msg.data[--msg.sz] = 0;
+		while (msg->sz && msg->data[msg->sz-1] == '\n')
+			msg->data[--msg->sz] = 0;
 
-		if (macro_parse(msg.data, &macro)) {
+		memset(&arena, 0, sizeof arena);
+		if (macro_parse(msg->data, &arena)) {
 			send_fail(con, "%s", errstr);
 			return;
 		}
 
-		macro_execute(send_key_macro_wrapper, NULL, &macro, msg.timeout);
+		macro.entries = arena.entries;
+		macro.sz = arena.sz;
+
+		macro_execute(ipc_send_key, ipc_delay, NULL, &macro, msg->timeout);
+		macro_arena_free(&arena);
 		send_success(con);
 
 		break;
 	case IPC_INPUT:
-		if (input(msg.data, msg.sz, msg.timeout))
+		if (input(msg->data, msg->sz, msg->timeout))
 			send_fail(con, "%s", errstr);
 		else
 			send_success(con);
 		break;
 	case IPC_RELOAD:
-		reload();
+		reload(1);
 		send_success(con);
 		break;
 	case IPC_LAYER_LISTEN:
@@ -448,15 +860,15 @@ static void handle_client(int con)
 	case IPC_BIND:
 		success = 0;
 
-		if (msg.sz == sizeof(msg.data)) {
+		if (msg->sz == sizeof(msg->data)) {
 			send_fail(con, "bind expression size exceeded");
 			return;
 		}
 
-		msg.data[msg.sz] = 0;
+		msg->data[msg->sz] = 0;
 
 		for (ent = configs; ent; ent = ent->next) {
-			if (!kbd_eval(ent->kbd, msg.data))
+			if (!kbd_eval(ent->kbd, msg->data))
 				success = 1;
 		}
 
@@ -473,7 +885,81 @@ static void handle_client(int con)
 	}
 }
 
-static long process_keypress(struct keyboard *kbd, uint8_t code, int timestamp)
+static void remove_client(size_t idx)
+{
+	evloop_remove_fd(clients[idx].fd);
+
+	nr_clients--;
+	memmove(&clients[idx], &clients[idx+1], (nr_clients - idx) * sizeof clients[0]);
+}
+
+static void accept_clients(void)
+{
+	int con;
+
+	while ((con = accept(ipcfd, NULL, 0)) >= 0) {
+		/* Make room by dropping the oldest incomplete request. */
+		if (nr_clients == ARRAY_SIZE(clients)) {
+			close(clients[0].fd);
+			remove_client(0);
+		}
+
+		set_nonblocking(con, 1);
+
+		clients[nr_clients].fd = con;
+		clients[nr_clients].sz = 0;
+		nr_clients++;
+
+		evloop_add_fd(con);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+		perror("accept");
+		exit(-1);
+	}
+}
+
+/* Reads whatever is available and dispatches the request once it is complete. */
+static void read_client(size_t idx, int error)
+{
+	struct client *client = &clients[idx];
+	int con = client->fd;
+	ssize_t n = 0;
+
+	while (!error && client->sz != sizeof client->msg) {
+		n = read(con, (char *)&client->msg + client->sz, sizeof client->msg - client->sz);
+
+		if (n <= 0)
+			break;
+
+		client->sz += n;
+	}
+
+	if (!error && client->sz == sizeof client->msg) {
+		struct ipc_message msg = client->msg;
+
+		remove_client(idx);
+
+		/* The connection stays non-blocking (see send_reply()). */
+		handle_request(con, &msg);
+	} else if (error || n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		remove_client(idx);
+		close(con);
+	}
+}
+
+static void handle_client(int fd, int error)
+{
+	size_t i;
+
+	for (i = 0; i < nr_clients; i++)
+		if (clients[i].fd == fd) {
+			read_client(i, error);
+			return;
+		}
+}
+
+static void process_keypress(struct keyboard *kbd, uint8_t code, uint64_t timestamp)
 {
 	struct key_event kev = {
 		.code = code,
@@ -484,29 +970,67 @@ static long process_keypress(struct keyboard *kbd, uint8_t code, int timestamp)
 	kbd_process_events(kbd, &kev, 1);
 
 	kev.pressed = 0;
-	return kbd_process_events(kbd, &kev, 1);
+	kbd_process_events(kbd, &kev, 1);
 }
 
-static int event_handler(struct event *ev)
+static void flush_frame(void)
 {
-	static int last_time = 0;
-	static int timeout = 0;
+	size_t sz = frame.sz;
+
+	frame.sz = 0;
+	kbd_process_frame(frame.kbd, frame.events, sz);
+}
+
+/* Arms the event loop timer for the earliest pending deadline. */
+static void schedule_timeout(uint64_t output_timeout)
+{
+	struct config_ent *ent;
+	uint64_t timeout = output_timeout;
+	uint64_t ipc_timeout = macro_queue_deadline(&ipc_queue);
+
+	if (ipc_timeout && (!timeout || ipc_timeout < timeout))
+		timeout = ipc_timeout;
+
+	for (ent = configs; ent; ent = ent->next)
+		if (ent->timeout && (!timeout || ent->timeout < timeout))
+			timeout = ent->timeout;
+
+	if (reload_time && (!timeout || reload_time < timeout))
+		timeout = reload_time;
+
+	evloop_set_timeout(timeout);
+}
+
+static void event_handler(struct event *ev)
+{
+	struct config_ent *ent;
 	struct key_event kev = {0};
 
-	timeout -= ev->timestamp - last_time;
-	last_time = ev->timestamp;
+	current_time = ev->timestamp;
 
-	timeout = timeout < 0 ? 0 : timeout;
+	if (frame.sz && !(ev->type == EV_DEV_EVENT &&
+			  ev->dev == frame.dev &&
+			  ev->devev->type == DEV_KEY))
+		flush_frame();
 
 	switch (ev->type) {
 	case EV_TIMEOUT:
-		if (!active_kbd)
-			return 0;
+		/* EV_TIMEOUT may also be the result of pending output. */
+		macro_queue_drain(&ipc_queue, ev->timestamp, send_key_wrapper, NULL);
+
+		for (ent = configs; ent; ent = ent->next) {
+			if (ent->timeout && ent->timeout <= ev->timestamp) {
+				ent->timeout = 0;
 
-		kev.code = 0;
-		kev.timestamp = ev->timestamp;
+				kev.code = 0;
+				kev.timestamp = ev->timestamp;
 
-		timeout = kbd_process_events(active_kbd, &kev, 1);
+				kbd_process_events(ent->kbd, &kev, 1);
+			}
+		}
+
+		if (reload_time && reload_time <= ev->timestamp)
+			reload(0);
 		break;
 	case EV_DEV_EVENT:
 		if (ev->dev->data) {
@@ -517,11 +1041,15 @@ static int event_handler(struct event *ev)
 			case DEV_KEY:
 				dbg("input %s %s", KEY_NAME(ev->devev->code), ev->devev->pressed ? "down" : "up");
 
-				kev.code = ev->devev->code;
-				kev.pressed = ev->devev->pressed;
-				kev.timestamp = ev->timestamp;
+				if (frame.sz == ARRAY_SIZE(frame.events))
+					flush_frame();
 
-				timeout = kbd_process_events(kbd, &kev, 1);
+				frame.dev = ev->dev;
+				frame.kbd = kbd;
+				frame.events[frame.sz].code = ev->devev->code;
+				frame.events[frame.sz].pressed = ev->devev->pressed;
+				frame.events[frame.sz].timestamp = ev->timestamp;
+				frame.sz++;
 				break;
 			case DEV_MOUSE_MOVE:
 				if (kbd->scroll.active) {
@@ -551,16 +1079,16 @@ static int event_handler(struct event *ev)
 				if (active_kbd) {
 					if (ev->devev->x > 0)
 						for (i = 0;i < (size_t)ev->devev->x; i++)
-							timeout = process_keypress(active_kbd, KEYD_SCROLL_RIGHT, ev->timestamp);
+							process_keypress(active_kbd, KEYD_SCROLL_RIGHT, ev->timestamp);
 					if (ev->devev->x < 0)
 						for (i = 0;i < (size_t)-1*ev->devev->x; i++)
-							timeout = process_keypress(active_kbd, KEYD_SCROLL_LEFT, ev->timestamp);
+							process_keypress(active_kbd, KEYD_SCROLL_LEFT, ev->timestamp);
 					if (ev->devev->y > 0)
 						for (i = 0;i < (size_t)ev->devev->y; i++)
-							timeout = process_keypress(active_kbd, KEYD_SCROLL_UP, ev->timestamp);
+							process_keypress(active_kbd, KEYD_SCROLL_UP, ev->timestamp);
 					if (ev->devev->y < 0)
 						for (i = 0;i < (size_t)-1*ev->devev->y; i++)
-							timeout = process_keypress(active_kbd, KEYD_SCROLL_DOWN, ev->timestamp);
+							process_keypress(active_kbd, KEYD_SCROLL_DOWN, ev->timestamp);
 				}
 				break;
 			default:
@@ -568,7 +1096,7 @@ static int event_handler(struct event *ev)
 			}
 		} else if (!ev->dev->is_virtual && ev->dev->capabilities & CAP_MOUSE) {
 			if (active_kbd && (ev->devev->type == DEV_KEY || ev->devev->type == DEV_MOUSE_SCROLL))
-				timeout = process_keypress(active_kbd, KEYD_EXTERNAL_MOUSE_BUTTON, ev->timestamp);
+				process_keypress(active_kbd, KEYD_EXTERNAL_MOUSE_BUTTON, ev->timestamp);
 		} else if (ev->dev->is_virtual && ev->devev->type == DEV_LED) {
 			size_t i;
 
@@ -592,21 +1120,21 @@ static int event_handler(struct event *ev)
 
 		break;
 	case EV_FD_ACTIVITY:
+	case EV_FD_ERR:
 		if (ev->fd == ipcfd) {
-			int con = accept(ipcfd, NULL, 0);
-			if (con < 0) {
-				perror("accept");
-				exit(-1);
-			}
-
-			handle_client(con);
+			if (ev->type == EV_FD_ACTIVITY)
+				accept_clients();
+		} else if (ev->fd == watchfd) {
+			handle_watch(ev->timestamp);
+		} else if (!handle_listener(ev->fd, ev->type == EV_FD_ERR)) {
+			handle_client(ev->fd, ev->type == EV_FD_ERR);
 		}
 		break;
 	default:
 		break;
 	}
 
-	return timeout;
+	schedule_timeout(vkbd_flush(vkbd));
 }
 
 int run_daemon(int argc, char *argv[])
@@ -617,11 +1145,15 @@ int run_daemon(int argc, char *argv[])
 	if (ipcfd < 0)
 		die("failed to create %s (another instance already running?)", SOCKET_PATH);
 
+	set_nonblocking(ipcfd, 1);
+
 	vkbd = vkbd_init(VKBD_NAME);
 
 	setvbuf(stdout, NULL, _IOLBF, 0);
 	setvbuf(stderr, NULL, _IOLBF, 0);
 
+	log_start_writer();
+
 	sp.sched_priority = 49;
 	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)) {
 		perror("pthread_setschedparam");
@@ -635,7 +1167,7 @@ int run_daemon(int argc, char *argv[])
 
 	evloop_add_fd(ipcfd);
 
-	reload();
+	reload(1);
 
 	atexit(cleanup);
 
@@ -162,6 +162,20 @@ static int device_init(const char *path, struct device *dev)
 
 	dbg_print_evdev_details(path);
 
+#ifdef EVIOCSCLOCKID
+	/* Make event times comparable with clock_gettime(CLOCK_MONOTONIC). */
+	{
+		int clk = CLOCK_MONOTONIC;
+
+		if (ioctl(fd, EVIOCSCLOCKID, &clk) < 0) {
+			dbg("failed to set the clock of %s", path);
+			dev->_stamp_events = 1;
+		}
+	}
+#else
+	dev->_stamp_events = 1;
+#endif
+
 	capabilities = resolve_device_capabilities(fd, &num_keys, &relmask, &absmask);
 
 	if (ioctl(fd, EVIOCGNAME(sizeof(dev->name)), dev->name) == -1) {
@@ -406,40 +420,51 @@ int device_ungrab(struct device *dev)
 }
 
 /*
- * Read a device event from the given device or return
- * NULL if none are available (may happen in the
- * case of a spurious wakeup).
+ * Translate a raw evdev event into a device event. Returns 0 if the event
+ * produced a device event and -1 otherwise.
  */
-struct device_event *device_read_event(struct device *dev)
+static uint64_t event_time(const struct device *dev, const struct input_event *ev)
 {
-	struct input_event ev;
-	static struct device_event devev;
-
-	assert(dev->fd != -1);
+	if (dev->_stamp_events) {
+		struct timespec ts;
 
-	if (read(dev->fd, &ev, sizeof(ev)) < 0) {
-		if (errno == EAGAIN) {
-			return NULL;
-		} else {
-			dev->fd = -1;
-			devev.type = DEV_REMOVED;
-			return &devev;
-		}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 	}
 
+	return ev->input_event_sec * 1000000ULL + ev->input_event_usec;
+}
+
+static int key_state(const uint8_t *keys, size_t code)
+{
+	return (keys[code / 8] >> (code % 8)) & 0x1;
+}
+
+static void set_key_state(uint8_t *keys, size_t code, int state)
+{
+	if (state)
+		keys[code / 8] |= 1 << (code % 8);
+	else
+		keys[code / 8] &= ~(1 << (code % 8));
+}
+
+static int translate_event(struct device *dev, struct input_event ev, struct device_event *devev)
+{
+	devev->timestamp = event_time(dev, &ev);
+
 	switch (ev.type) {
 	case EV_REL:
 		switch (ev.code) {
 		case REL_WHEEL:
-			devev.type = DEV_MOUSE_SCROLL;
-			devev.y = ev.value;
-			devev.x = 0;
+			devev->type = DEV_MOUSE_SCROLL;
+			devev->y = ev.value;
+			devev->x = 0;
 
 			break;
 		case REL_HWHEEL:
-			devev.type = DEV_MOUSE_SCROLL;
-			devev.y = 0;
-			devev.x = ev.value;
+			devev->type = DEV_MOUSE_SCROLL;
+			devev->y = 0;
+			devev->x = ev.value;
 
 			break;
 		case REL_X:
@@ -449,54 +474,60 @@ struct device_event *device_read_event(struct device *dev)
 			 */
 			dev->_pending_rel_x += ev.value;
 
-			return NULL;
+			return -1;
 			break;
 		case REL_Y:
 			dev->_pending_rel_y += ev.value;
 
-			return NULL;
+			return -1;
 			break;
 //		case REL_WHEEL_HI_RES:
 //			/* TODO: implement me */
-//			return NULL;
+//			return -1;
 //		case REL_HWHEEL_HI_RES:
 //			/* TODO: implement me */
-//			return NULL;
+//			return -1;
 		default:
 			dbg("Unrecognized EV_REL code: %d\n", ev.code);
-			return NULL;
+			return -1;
 		}
 
 		break;
 	case EV_SYN:
+		if (ev.code != SYN_REPORT)
+			return -1;
+
 		if (dev->_pending_rel_x || dev->_pending_rel_y) {
-			devev.type = DEV_MOUSE_MOVE;
-			devev.y = dev->_pending_rel_y;
-			devev.x = dev->_pending_rel_x;
+			devev->type = DEV_MOUSE_MOVE;
+			devev->y = dev->_pending_rel_y;
+			devev->x = dev->_pending_rel_x;
 
 			dev->_pending_rel_y = 0;
 			dev->_pending_rel_x = 0;
+
+			/* Terminate the frame on the next read. */
+			dev->_pending_syn = 1;
 		} else {
-			return NULL;
+			devev->type = DEV_SYN;
 		}
 		break;
 	case EV_ABS:
 		switch (ev.code) {
 		case ABS_X:
-			devev.type = DEV_MOUSE_MOVE_ABS;
-			devev.x = (ev.value * 1024) / (dev->_maxx - dev->_minx);
-			devev.y = 0;
+			devev->type = DEV_MOUSE_MOVE_ABS;
+			devev->x = (ev.value * 1024) / (dev->_maxx - dev->_minx);
+			devev->y = 0;
 
 			break;
 		case ABS_Y:
-			devev.type = DEV_MOUSE_MOVE_ABS;
-			devev.y = (ev.value * 1024) / (dev->_maxy - dev->_miny);
-			devev.x = 0;
+			devev->type = DEV_MOUSE_MOVE_ABS;
+			devev->y = (ev.value * 1024) / (dev->_maxy - dev->_miny);
+			devev->x = 0;
 
 			break;
 		default:
 			dbg("Unrecognized EV_ABS code: %x", ev.code);
-			return NULL;
+			return -1;
 		}
 
 		break;
@@ -508,7 +539,10 @@ struct device_event *device_read_event(struct device *dev)
 
 		/* Ignore repeat events. */
 		if (ev.value == 2)
-			return NULL;
+			return -1;
+
+		if (ev.code < KEY_CNT)
+			set_key_state(dev->_keys, ev.code, ev.value);
 
 		if (ev.code >= 256) {
 			switch (ev.code) {
@@ -605,30 +639,179 @@ struct device_event *device_read_event(struct device *dev)
 
 				default:
 					dbg("unsupported evdev code: 0x%x\n", ev.code);
-					return NULL;
+					return -1;
 			}
 		}
 
-		devev.type = DEV_KEY;
-		devev.code = ev.code;
-		devev.pressed = ev.value;
+		devev->type = DEV_KEY;
+		devev->code = ev.code;
+		devev->pressed = ev.value;
 
-		dbg2("key %s %s", KEY_NAME(devev.code), devev.pressed ? "down" : "up");
+		dbg2("key %s %s", KEY_NAME(devev->code), devev->pressed ? "down" : "up");
 
 		break;
 	case EV_LED:
-		devev.type = DEV_LED;
-		devev.code = ev.code;
-		devev.pressed = ev.value;
+		devev->type = DEV_LED;
+		devev->code = ev.code;
+		devev->pressed = ev.value;
 
 		break;
 	default:
 		if (ev.type)
 			dbg2("unrecognized evdev event type: %d %d %d", ev.type, ev.code, ev.value);
-		return NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Called once the events following a SYN_DROPPED have been discarded (i.e on
+ * the next SYN_REPORT). Records the actual key state so that the difference
+ * can be emitted by resync_event().
+ */
+static void begin_resync(struct device *dev)
+{
+	dev->_dropping = 0;
+	dev->_pending_rel_x = 0;
+	dev->_pending_rel_y = 0;
+
+	memset(dev->_synced_keys, 0, sizeof dev->_synced_keys);
+	if (ioctl(dev->fd, EVIOCGKEY(sizeof dev->_synced_keys), dev->_synced_keys) < 0)
+		memcpy(dev->_synced_keys, dev->_keys, sizeof dev->_keys);
+
+	dev->_resyncing = 1;
+}
+
+/*
+ * Produces the next key event required to bring the reader's view of the key
+ * state in line with the device, followed by a DEV_SYN once there are none
+ * left.
+ */
+static void resync_event(struct device *dev, struct device_event *devev)
+{
+	size_t i;
+	/* The SYN_REPORT which ended the drop. */
+	const struct input_event *syn = &dev->_buf[dev->_buf_pos-1];
+
+	for (i = 0; i < KEY_CNT; i++) {
+		int state = key_state(dev->_synced_keys, i);
+
+		if (key_state(dev->_keys, i) != state) {
+			struct input_event ev = {
+				.input_event_sec = syn->input_event_sec,
+				.input_event_usec = syn->input_event_usec,
+				.type = EV_KEY,
+				.code = i,
+				.value = state,
+			};
+
+			/* Updates dev->_keys, even if the key is unsupported. */
+			if (!translate_event(dev, ev, devev))
+				return;
+		}
+	}
+
+	dev->_resyncing = 0;
+
+	devev->type = DEV_SYN;
+	devev->timestamp = event_time(dev, syn);
+}
+
+/*
+ * Read up to n events from the given device, returning the number of events
+ * read. 0 is returned if none are available (which may happen in the case of
+ * a spurious wakeup).
+ *
+ * Raw events are consumed from the kernel in batches of up to DEVICE_BUFSZ
+ * per read(), so a complete frame typically costs a single syscall.
+ */
+size_t device_read_events(struct device *dev, struct device_event *events, size_t n)
+{
+	size_t nr = 0;
+
+	assert(dev->fd != -1);
+
+	while (nr < n) {
+		struct input_event *ev;
+
+		if (dev->_pending_syn) {
+			dev->_pending_syn = 0;
+			events[nr].type = DEV_SYN;
+			events[nr].timestamp = event_time(dev, &dev->_buf[dev->_buf_pos-1]);
+			nr++;
+			continue;
+		}
+
+		if (dev->_resyncing) {
+			resync_event(dev, &events[nr++]);
+			continue;
+		}
+
+		if (dev->_buf_pos == dev->_buf_sz) {
+			ssize_t sz;
+
+			/*
+			 * A short read implies the kernel queue has been
+			 * drained, so there is no need to issue another
+			 * read() just to receive EAGAIN.
+			 */
+			if (dev->_buf_drained) {
+				if (!nr)
+					dev->_buf_drained = 0;
+				break;
+			}
+
+			sz = read(dev->fd, dev->_buf, sizeof dev->_buf);
+			if (sz < 0) {
+				if (errno != EAGAIN) {
+					dev->fd = -1;
+					events[nr++].type = DEV_REMOVED;
+				}
+
+				break;
+			}
+
+			dev->_buf_pos = 0;
+			dev->_buf_sz = sz / sizeof(struct input_event);
+			dev->_buf_drained = dev->_buf_sz < DEVICE_BUFSZ;
+		}
+
+		ev = &dev->_buf[dev->_buf_pos++];
+
+		/*
+		 * The kernel buffer overflowed: discard everything up to and
+		 * including the next SYN_REPORT and then resynchronize the key
+		 * state (as libevdev does).
+		 */
+		if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+			dev->_dropping = 1;
+			continue;
+		}
+
+		if (dev->_dropping) {
+			if (ev->type == EV_SYN && ev->code == SYN_REPORT)
+				begin_resync(dev);
+			continue;
+		}
+
+		if (!translate_event(dev, *ev, &events[nr]))
+			nr++;
 	}
 
-	return &devev;
+	return nr;
+}
+
+/*
+ * Read a device event from the given device or return
+ * NULL if none are available (may happen in the
+ * case of a spurious wakeup).
+ */
+struct device_event *device_read_event(struct device *dev)
+{
+	static struct device_event devev;
+
+	return device_read_events(dev, &devev, 1) ? &devev : NULL;
 }
 
 void device_set_led(const struct device *dev, int led, int state)
@@ -6,14 +6,22 @@
 #ifndef DEVICE_H
 #define DEVICE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#ifdef __FreeBSD__
+	#include <dev/evdev/input.h>
+#else
+	#include <linux/input.h>
+#endif
+
 #define CAP_MOUSE	0x1
 #define CAP_MOUSE_ABS	0x2
 #define CAP_KEYBOARD	0x4
 #define CAP_KEY		0x8 // Can emit keys, but is not necessarily a keyboard
 
 #define MAX_DEVICES	64
+#define DEVICE_BUFSZ	32 /* The maximum number of evdev events consumed per read(). */
 
 struct device {
 	/*
@@ -39,6 +47,24 @@ struct device {
 	uint32_t _pending_rel_x;
 	uint32_t _pending_rel_y;
 
+	struct input_event _buf[DEVICE_BUFSZ];
+	uint8_t _buf_sz;
+	uint8_t _buf_pos;
+	uint8_t _buf_drained;
+	uint8_t _pending_syn;
+
+	/* Set if event times are not CLOCK_MONOTONIC and must be stamped on receipt. */
+	uint8_t _stamp_events;
+
+	/*
+	 * Key state as last reported to the reader, and the actual state
+	 * recovered after the kernel buffer overflowed (SYN_DROPPED).
+	 */
+	uint8_t _keys[KEY_CNT / 8];
+	uint8_t _synced_keys[KEY_CNT / 8];
+	uint8_t _dropping;
+	uint8_t _resyncing;
+
 	/* Reserved for the user. */
 	void *data;
 };
@@ -53,6 +79,9 @@ struct device_event {
 		DEV_MOUSE_MOVE_ABS,
 		DEV_MOUSE_SCROLL,
 
+		/* Marks the end of an input frame (EV_SYN). */
+		DEV_SYN,
+
 		DEV_REMOVED,
 	} type;
 
@@ -61,10 +90,14 @@ struct device_event {
 
 	int32_t x;
 	int32_t y;
+
+	/* Kernel event time (CLOCK_MONOTONIC) in microseconds. */
+	uint64_t timestamp;
 };
 
 
 struct device_event *device_read_event(struct device *dev);
+size_t device_read_events(struct device *dev, struct device_event *events, size_t n);
 
 int device_scan(struct device devices[MAX_DEVICES]);
 int device_grab(struct device *dev);
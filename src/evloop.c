@@ -1,13 +1,31 @@
 #include "keyd.h"
 
-#define MAX_AUX_FDS 32
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+/* Auxiliary fds (e.g IPC connections) for which EV_FD_* events are generated. */
+static struct aux_fd {
+	int fd;
+	short events; /* POLLIN or POLLOUT */
+} *aux_fds;
 
-static int aux_fds[MAX_AUX_FDS];
 static size_t nr_aux_fds = 0;
+static size_t aux_fds_sz = 0;
 
 struct device device_table[MAX_DEVICES];
 size_t device_table_sz;
 
+static void (*event_handler) (struct event *ev);
+static int monfd;
+
+/* Absolute CLOCK_MONOTONIC time (in microseconds) of the next EV_TIMEOUT. */
+static uint64_t deadline = 0;
+
+/* The timestamp of the last dispatched event. */
+static uint64_t last_timestamp = 0;
+
 static void panic_check(uint8_t code, uint8_t pressed)
 {
 	static uint8_t enter, backspace, escape;
@@ -27,38 +45,280 @@ static void panic_check(uint8_t code, uint8_t pressed)
 		die("panic sequence detected");
 }
 
-static long get_time_ms(void)
+static uint64_t get_time_us(void)
 {
 	struct timespec ts;
 	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return ts.tv_sec * 1E3 + ts.tv_nsec / 1E6;
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 }
 
-int evloop(int (*event_handler) (struct event *ev))
+/*
+ * Device events carry their kernel time and may thus predate the time at
+ * which a timeout was dispatched. Clamp them so that the keyboard logic
+ * always observes monotonic timestamps.
+ */
+static void set_timestamp(struct event *ev, uint64_t time)
 {
-	size_t i;
-	int timeout = 0;
-	int monfd;
+	if (time > last_timestamp)
+		last_timestamp = time;
 
-	struct pollfd pfds[MAX_DEVICES+MAX_AUX_FDS+1];
+	ev->timestamp = last_timestamp;
+}
 
-	struct event ev;
+#ifdef __linux__
 
-	monfd = devmon_create();
-	device_table_sz = device_scan(device_table);
+/*
+ * Each registered fd carries its origin and table index (or, in the case of
+ * aux fds, the fd itself) so that only the descriptors which are actually
+ * ready need to be visited on wakeup. Registrations persist across
+ * iterations and are only updated when the device table changes.
+ */
+
+enum {
+	SRC_MONITOR,
+	SRC_DEVICE,
+	SRC_AUX,
+	SRC_TIMER,
+};
+
+static int epfd = -1;
+static int tfd = -1;
+
+static void arm_timer(void)
+{
+	struct itimerspec its = {0};
+
+	its.it_value.tv_sec = deadline / 1000000;
+	its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+
+	/* A zero value disarms the timer. */
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		exit(-1);
+	}
+}
+
+static void watch_fd(int op, int fd, uint32_t events, int src, size_t idx)
+{
+	struct epoll_event ev = {
+		.events = events,
+		.data.u64 = (uint64_t)src << 32 | idx,
+	};
+
+	if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(-1);
+	}
+}
+
+static void unwatch_fd(int fd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void watch_aux_fd(const struct aux_fd *aux)
+{
+	watch_fd(EPOLL_CTL_ADD, aux->fd, aux->events == POLLOUT ? EPOLLOUT : EPOLLIN,
+		 SRC_AUX, aux->fd);
+}
+
+#endif
+
+/* Returns 1 if the device was removed. */
+static int read_device(size_t idx, struct event *ev)
+{
+	struct device_event events[DEVICE_BUFSZ];
+	struct device *dev = &device_table[idx];
+	int fd = dev->fd;
+	size_t n;
+
+	while ((n = device_read_events(dev, events, ARRAY_SIZE(events)))) {
+		size_t i;
+
+		for (i = 0; i < n; i++) {
+			struct device_event *devev = &events[i];
+
+			if (devev->type == DEV_REMOVED) {
+#ifdef __linux__
+				unwatch_fd(fd);
+#endif
+				ev->type = EV_DEV_REMOVE;
+				ev->dev = dev;
+
+				event_handler(ev);
+
+				dev->fd = -1;
+				return 1;
+			} else {
+				// Handle device event
+				if (!dev->is_virtual && devev->type == DEV_KEY)
+					panic_check(devev->code, devev->pressed);
+
+				ev->type = EV_DEV_EVENT;
+				ev->devev = devev;
+				ev->dev = dev;
+				set_timestamp(ev, devev->timestamp);
+
+				event_handler(ev);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void read_monitor(struct event *ev)
+{
+	struct device dev;
+
+	while (devmon_read_device(monfd, &dev) == 0) {
+		assert(device_table_sz < MAX_DEVICES);
+		device_table[device_table_sz++] = dev;
+
+#ifdef __linux__
+		watch_fd(EPOLL_CTL_ADD, dev.fd, EPOLLIN, SRC_DEVICE, device_table_sz-1);
+#endif
+
+		ev->type = EV_DEV_ADD;
+		ev->dev = &device_table[device_table_sz-1];
+
+		event_handler(ev);
+	}
+}
+
+static void remove_devices(void)
+{
+	size_t i;
+	size_t n = 0;
 
 	for (i = 0; i < device_table_sz; i++) {
-		ev.type = EV_DEV_ADD;
-		ev.dev = &device_table[i];
+		if (device_table[i].fd != -1) {
+#ifdef __linux__
+			if (n != i)
+				watch_fd(EPOLL_CTL_MOD, device_table[i].fd, EPOLLIN, SRC_DEVICE, n);
+#endif
+			device_table[n++] = device_table[i];
+		}
+	}
 
-		event_handler(&ev);
+	device_table_sz = n;
+}
+
+/* Dispatches EV_TIMEOUT if the current deadline has passed. */
+static void dispatch_timeout(struct event *ev)
+{
+	uint64_t now = get_time_us();
+
+	if (!deadline || now < deadline)
+		return;
+
+	deadline = 0;
+	set_timestamp(ev, now);
+
+	ev->type = EV_TIMEOUT;
+	ev->dev = NULL;
+	ev->devev = NULL;
+
+	event_handler(ev);
+}
+
+#ifdef __linux__
+
+static void loop(struct event *ev)
+{
+	size_t i;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(-1);
+	}
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("timerfd_create");
+		exit(-1);
 	}
 
+	arm_timer();
+
+	watch_fd(EPOLL_CTL_ADD, monfd, EPOLLIN, SRC_MONITOR, 0);
+	watch_fd(EPOLL_CTL_ADD, tfd, EPOLLIN, SRC_TIMER, 0);
+
+	for (i = 0; i < device_table_sz; i++)
+		watch_fd(EPOLL_CTL_ADD, device_table[i].fd, EPOLLIN, SRC_DEVICE, i);
+
+	for (i = 0; i < nr_aux_fds; i++)
+		watch_aux_fd(&aux_fds[i]);
+
 	while (1) {
+		int n;
 		int removed = 0;
+		int timer_expired = 0;
+		struct epoll_event events[MAX_DEVICES+64];
+
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+		ev->timestamp = get_time_us();
+
+		for (i = 0; i < (size_t)n; i++) {
+			size_t idx = (uint32_t)events[i].data.u64;
+
+			switch (events[i].data.u64 >> 32) {
+			case SRC_DEVICE:
+				removed |= read_device(idx, ev);
+				break;
+			case SRC_AUX:
+				ev->type = events[i].events & EPOLLERR ? EV_FD_ERR : EV_FD_ACTIVITY;
+				ev->fd = idx;
+
+				event_handler(ev);
+				break;
+			case SRC_MONITOR:
+				read_monitor(ev);
+				break;
+			case SRC_TIMER:
+				timer_expired = 1;
+				break;
+			}
+		}
+
+		/*
+		 * Dispatched last, so that input which arrived before the
+		 * deadline is processed first.
+		 */
+		if (timer_expired) {
+			uint64_t expirations;
+
+			if (read(tfd, &expirations, sizeof expirations) < 0 && errno != EAGAIN) {
+				perror("read timerfd");
+				exit(-1);
+			}
 
-		int start_time;
-		int elapsed;
+			dispatch_timeout(ev);
+		}
+
+		if (removed)
+			remove_devices();
+	}
+}
+
+#else
+
+static void loop(struct event *ev)
+{
+	size_t i;
+	struct pollfd *pfds = NULL;
+	size_t pfds_sz = 0;
+
+	while (1) {
+		size_t n;
+		int removed = 0;
+		int timeout = -1;
+
+		if (pfds_sz < device_table_sz+nr_aux_fds+1) {
+			pfds_sz = device_table_sz+nr_aux_fds+1;
+			pfds = realloc(pfds, pfds_sz * sizeof pfds[0]);
+		}
 
 		pfds[0].fd = monfd;
 		pfds[0].events = POLLIN;
@@ -69,96 +329,130 @@ int evloop(int (*event_handler) (struct event *ev))
 		}
 
 		for (i = 0; i < nr_aux_fds; i++) {
-			pfds[i+device_table_sz+1].fd = aux_fds[i];
-			pfds[i+device_table_sz+1].events = POLLIN | POLLERR;
+			pfds[i+device_table_sz+1].fd = aux_fds[i].fd;
+			pfds[i+device_table_sz+1].events = aux_fds[i].events | POLLERR;
 		}
 
-		start_time = get_time_ms();
-		poll(pfds, device_table_sz+nr_aux_fds+1, timeout > 0 ? timeout : -1);
-		ev.timestamp = get_time_ms();
-		elapsed = ev.timestamp - start_time;
-
-		if (timeout > 0 && elapsed >= timeout) {
-			ev.type = EV_TIMEOUT;
-			ev.dev = NULL;
-			ev.devev = NULL;
-			timeout = event_handler(&ev);
-		} else {
-			timeout -= elapsed;
+		if (deadline) {
+			uint64_t now = get_time_us();
+
+			timeout = now < deadline ? (deadline - now + 999) / 1000 : 0;
 		}
 
+		poll(pfds, device_table_sz+nr_aux_fds+1, timeout);
+		ev->timestamp = get_time_us();
+
 		for (i = 0; i < device_table_sz; i++) {
-			if (pfds[i+1].revents) {
-				struct device_event *devev;
-				struct device *dev = &device_table[i];
-
-				while ((devev = device_read_event(dev))) {
-					if (devev->type == DEV_REMOVED) {
-						ev.type = EV_DEV_REMOVE;
-						ev.dev = dev;
-
-						timeout = event_handler(&ev);
-
-						dev->fd = -1;
-						removed = 1;
-						break;
-					} else {
-						// Handle device event
-						if (!dev->is_virtual && devev->type == DEV_KEY)
-							panic_check(devev->code, devev->pressed);
-
-						ev.type = EV_DEV_EVENT;
-						ev.devev = devev;
-						ev.dev = dev;
-
-						timeout = event_handler(&ev);
-					}
-				}
-			}
+			if (pfds[i+1].revents)
+				removed |= read_device(i, ev);
 		}
 
-		for (i = 0; i < nr_aux_fds; i++) {
+		/* The handler may add or remove aux fds. */
+		n = nr_aux_fds;
+		for (i = 0; i < n; i++) {
 			short events = pfds[i+device_table_sz+1].revents;
 
 			if (events) {
-				ev.type = events & POLLERR ? EV_FD_ERR : EV_FD_ACTIVITY;
-				ev.fd = aux_fds[i];
+				ev->type = events & POLLERR ? EV_FD_ERR : EV_FD_ACTIVITY;
+				ev->fd = pfds[i+device_table_sz+1].fd;
 
-				timeout = event_handler(&ev);
+				event_handler(ev);
 			}
 		}
 
+		if (pfds[0].revents)
+			read_monitor(ev);
 
-		if (pfds[0].revents) {
-			struct device dev;
+		dispatch_timeout(ev);
 
-			while (devmon_read_device(monfd, &dev) == 0) {
-				assert(device_table_sz < MAX_DEVICES);
-				device_table[device_table_sz++] = dev;
+		if (removed)
+			remove_devices();
+	}
+}
 
-				ev.type = EV_DEV_ADD;
-				ev.dev = &device_table[device_table_sz-1];
+#endif
 
-				timeout = event_handler(&ev);
-			}
-		}
+int evloop(void (*handler) (struct event *ev))
+{
+	size_t i;
+	struct event ev;
 
-		if (removed) {
-			size_t n = 0;
-			for (i = 0; i < device_table_sz; i++) {
-				if (device_table[i].fd != -1)
-					device_table[n++] = device_table[i];
-			}
-			device_table_sz = n;
-		}
+	event_handler = handler;
+
+	monfd = devmon_create();
+	device_table_sz = device_scan(device_table);
+
+	for (i = 0; i < device_table_sz; i++) {
+		ev.type = EV_DEV_ADD;
+		ev.dev = &device_table[i];
 
+		event_handler(&ev);
 	}
 
+	loop(&ev);
+
 	return 0;
 }
 
+static void add_aux_fd(int fd, short events)
+{
+	if (nr_aux_fds == aux_fds_sz) {
+		aux_fds_sz = aux_fds_sz ? aux_fds_sz * 2 : 16;
+		aux_fds = realloc(aux_fds, aux_fds_sz * sizeof aux_fds[0]);
+	}
+
+	aux_fds[nr_aux_fds].fd = fd;
+	aux_fds[nr_aux_fds].events = events;
+
+#ifdef __linux__
+	if (epfd != -1)
+		watch_aux_fd(&aux_fds[nr_aux_fds]);
+#endif
+
+	nr_aux_fds++;
+}
+
+/* Generates EV_FD_ACTIVITY whenever the given fd becomes readable. */
 void evloop_add_fd(int fd)
 {
-	assert(nr_aux_fds < MAX_AUX_FDS);
-	aux_fds[nr_aux_fds++] = fd;
+	add_aux_fd(fd, POLLIN);
+}
+
+/* Generates EV_FD_ACTIVITY whenever the given fd becomes writable. */
+void evloop_add_output_fd(int fd)
+{
+	add_aux_fd(fd, POLLOUT);
+}
+
+/* Stops monitoring an fd previously passed to evloop_add_fd() (does not close it). */
+void evloop_remove_fd(int fd)
+{
+	size_t i;
+
+	for (i = 0; i < nr_aux_fds; i++) {
+		if (aux_fds[i].fd == fd) {
+			aux_fds[i] = aux_fds[--nr_aux_fds];
+			break;
+		}
+	}
+
+#ifdef __linux__
+	if (epfd != -1)
+		unwatch_fd(fd);
+#endif
+}
+
+/*
+ * Schedules an EV_TIMEOUT at the given absolute CLOCK_MONOTONIC time (in
+ * microseconds), replacing any previously scheduled timeout. A value of 0
+ * cancels the pending timeout.
+ */
+void evloop_set_timeout(uint64_t time)
+{
+	deadline = time;
+
+#ifdef __linux__
+	if (tfd != -1)
+		arm_timer();
+#endif
 }
@@ -6,63 +6,211 @@
 
 #include "keyd.h"
 
-static long process_event(struct keyboard *kbd, uint8_t code, int pressed, long time);
+static uint64_t process_event(struct keyboard *kbd, uint8_t code, int pressed, uint64_t time);
 
 /*
  * Here be tiny dragons.
  */
 
-static long get_time(void)
+#define LAYER_BIT(idx) ((uint32_t)1 << (idx))
+
+/* Returns the index of the highest set bit in the (non-zero) mask. */
+static int highest_layer(uint32_t mask)
 {
-	/* Close enough :/. Using a syscall is unnecessary. */
-	static long time = 1;
-	return time++;
+	return 31 - __builtin_clz(mask);
 }
 
-static int cache_set(struct keyboard *kbd, uint8_t code, struct cache_entry *ent)
+static const struct descriptor *get_descriptor(struct keyboard *kbd, int idx)
+{
+	return config_get_descriptor(kbd->config, &kbd->overlay, idx);
+}
+
+static struct macro get_macro(struct keyboard *kbd, int idx)
+{
+	return config_get_macro(kbd->config, &kbd->overlay, idx);
+}
+
+static const struct command *get_command(struct keyboard *kbd, int idx)
+{
+	return config_get_command(kbd->config, &kbd->overlay, idx);
+}
+
+/* Must be called whenever the config or overlay changes. */
+static void update_layer_masks(struct keyboard *kbd)
+{
+	size_t i, j;
+
+	memset(kbd->keymap_layers, 0, sizeof kbd->keymap_layers);
+	memset(kbd->overlay_chords, 0, sizeof kbd->overlay_chords);
+	kbd->composite_layers = 0;
+
+	for (i = 0; i < kbd->config->nr_layers; i++) {
+		struct layer *layer = &kbd->config->layers[i];
+
+		for (j = 0; j < 256; j++)
+			if (layer->keymap_mask[j / 64] & ((uint64_t)1 << (j % 64)))
+				kbd->keymap_layers[j] |= LAYER_BIT(i);
+
+		kbd->constituent_masks[i] = 0;
+		if (layer->type == LT_COMPOSITE) {
+			kbd->composite_layers |= LAYER_BIT(i);
+
+			for (j = 0; j < layer->nr_constituents; j++)
+				kbd->constituent_masks[i] |= LAYER_BIT(layer->constituents[j]);
+		}
+	}
+
+	for (i = 0; i < kbd->overlay.nr_chords; i++) {
+		const struct overlay_chord *oc = &kbd->overlay.chords[i];
+
+		kbd->overlay_chords[oc->layer] |= (uint64_t)1 << oc->idx;
+	}
+
+	for (i = 0; i < kbd->overlay.nr_bindings; i++) {
+		const struct binding *b = &kbd->overlay.bindings[i];
+
+		if (b->d.op)
+			kbd->keymap_layers[b->code] |= LAYER_BIT(b->layer);
+		else
+			kbd->keymap_layers[b->code] &= ~LAYER_BIT(b->layer);
+	}
+}
+
+static void layer_stack_remove(struct keyboard *kbd, int idx)
 {
 	size_t i;
-	int slot = -1;
 
-	for (i = 0; i < CACHE_SIZE; i++)
-		if (kbd->cache[i].code == code) {
-			slot = i;
-			break;
-		} else if (!kbd->cache[i].code) {
-			slot = i;
+	for (i = 0; i < kbd->layer_stack_sz; i++)
+		if (kbd->layer_stack[i] == idx) {
+			memmove(&kbd->layer_stack[i], &kbd->layer_stack[i+1],
+				kbd->layer_stack_sz - i - 1);
+			kbd->layer_stack_sz--;
+			return;
 		}
+}
+
+/*
+ * Returns the layer with the highest precedence amongst the given
+ * (non-empty) set of active layers.
+ */
+static int top_layer(const struct keyboard *kbd, uint32_t mask)
+{
+	size_t i = kbd->layer_stack_sz;
+
+	while (i--)
+		if (mask & LAYER_BIT(kbd->layer_stack[i]))
+			return kbd->layer_stack[i];
+
+	/* Either the active layout or main. */
+	return highest_layer(mask);
+}
+
+static void timer_place(struct keyboard *kbd, size_t i, struct timer timer)
+{
+	kbd->timers.heap[i] = timer;
+	kbd->timers.pos[timer.id] = i + 1;
+}
+
+/* Restores the heap property for a timer placed at position i. */
+static void timer_sift(struct keyboard *kbd, size_t i)
+{
+	struct timer *heap = kbd->timers.heap;
+	struct timer timer = heap[i];
+
+	while (i > 0 && heap[(i - 1) / 2].deadline > timer.deadline) {
+		timer_place(kbd, i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+
+	while (1) {
+		size_t child = 2 * i + 1;
+
+		if (child >= kbd->timers.sz)
+			break;
+
+		if (child + 1 < kbd->timers.sz && heap[child + 1].deadline < heap[child].deadline)
+			child++;
+
+		if (heap[child].deadline >= timer.deadline)
+			break;
+
+		timer_place(kbd, i, heap[child]);
+		i = child;
+	}
+
+	timer_place(kbd, i, timer);
+}
+
+static void cancel_timer(struct keyboard *kbd, enum timer_id id)
+{
+	size_t pos = kbd->timers.pos[id];
+
+	if (!pos)
+		return;
+
+	kbd->timers.pos[id] = 0;
+	kbd->timers.sz--;
+
+	if (pos - 1 != kbd->timers.sz) {
+		kbd->timers.heap[pos - 1] = kbd->timers.heap[kbd->timers.sz];
+		timer_sift(kbd, pos - 1);
+	}
+}
+
+/* (Re)arms the given timer, replacing its previous deadline. */
+static void set_timer(struct keyboard *kbd, enum timer_id id, uint64_t deadline)
+{
+	size_t pos = kbd->timers.pos[id];
+	struct timer timer = { .deadline = deadline, .id = id };
 
-	if (slot == -1)
-		return -1;
+	if (!pos)
+		pos = ++kbd->timers.sz;
 
+	kbd->timers.heap[pos - 1] = timer;
+	timer_sift(kbd, pos - 1);
+}
+
+#define CACHE_BIT(code) ((uint64_t)1 << ((code) % 64))
+
+static void cache_set(struct keyboard *kbd, uint8_t code, struct cache_entry *ent)
+{
 	if (ent == NULL) {
-		kbd->cache[slot].code = 0;
+		kbd->cache_occupied[code / 64] &= ~CACHE_BIT(code);
 	} else {
-		kbd->cache[slot] = *ent;
-		kbd->cache[slot].code = code;
+		kbd->cache[code] = *ent;
+		kbd->cache[code].code = code;
+		kbd->cache_occupied[code / 64] |= CACHE_BIT(code);
 	}
-
-	return 0;
 }
 
 static struct cache_entry *cache_get(struct keyboard *kbd, uint8_t code)
 {
-	size_t i;
-
-	for (i = 0; i < CACHE_SIZE; i++)
-		if (kbd->cache[i].code == code)
-			return &kbd->cache[i];
+	if (kbd->cache_occupied[code / 64] & CACHE_BIT(code))
+		return &kbd->cache[code];
 
 	return NULL;
 }
 
+static void output_key(void *ctx, uint8_t code, uint8_t pressed)
+{
+	struct keyboard *kbd = ctx;
+
+	kbd->output.send_key(code, pressed);
+}
+
+/* Preserves ordering with respect to any output still pending from a macro. */
+static void queue_key(struct keyboard *kbd, uint8_t code, uint8_t pressed)
+{
+	macro_queue_output(&kbd->macro_queue, code, pressed, output_key, kbd);
+}
+
 static void reset_keystate(struct keyboard *kbd)
 {
 	size_t i;
 
 	for (i = 0; i < 256; i++) {
 		if (kbd->keystate[i]) {
-			kbd->output.send_key(i, 0);
+			queue_key(kbd, i, 0);
 			kbd->keystate[i] = 0;
 		}
 	}
@@ -79,13 +227,25 @@ static void send_key(struct keyboard *kbd, uint8_t code, uint8_t pressed)
 
 	if (kbd->keystate[code] != pressed) {
 		kbd->keystate[code] = pressed;
-		kbd->output.send_key(code, pressed);
+		queue_key(kbd, code, pressed);
 	}
 }
 
-static void send_key_macro_wrapper(void *kbd, uint8_t code, uint8_t pressed)
+struct macro_ctx {
+	struct keyboard *kbd;
+	uint64_t time;
+};
+
+static void send_key_macro_wrapper(void *ctx, uint8_t code, uint8_t pressed)
+{
+	send_key(((struct macro_ctx *)ctx)->kbd, code, pressed);
+}
+
+static void delay_macro_wrapper(void *ctx, long usec)
 {
-	send_key(kbd, code, pressed);
+	struct macro_ctx *mctx = ctx;
+
+	macro_queue_delay(&mctx->kbd->macro_queue, mctx->time, usec);
 }
 
 static void clear_mod(struct keyboard *kbd, uint8_t code)
@@ -102,7 +262,7 @@ static void clear_mod(struct keyboard *kbd, uint8_t code)
 			 code == KEYD_LEFTALT ||
 			 code == KEYD_RIGHTALT)) &&
 		       !kbd->inhibit_modifier_guard &&
-		       !kbd->config.disable_modifier_guard);
+		       !kbd->config->disable_modifier_guard);
 
 	if (guard && !kbd->keystate[KEYD_LEFTCTRL]) {
 		send_key(kbd, KEYD_LEFTCTRL, 1);
@@ -134,30 +294,17 @@ static void set_mods(struct keyboard *kbd, uint8_t mods)
 // Returns the resultant mod mask.
 static uint8_t update_mods(struct keyboard *kbd, int excluded_layer_idx, uint8_t mods)
 {
-	size_t i;
-	struct layer *excluded_layer = excluded_layer_idx == -1 ?
-					NULL :
-					&kbd->config.layers[excluded_layer_idx];
-
-	for (i = 0; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
-		int excluded = 0;
-
-		if (!kbd->layer_state[i].active)
-			continue;
+	uint32_t layers = kbd->active_layers;
 
-		if (layer == excluded_layer) {
-			excluded = 1;
-		} else if (excluded_layer && excluded_layer->type == LT_COMPOSITE) {
-			size_t j;
+	if (excluded_layer_idx != -1)
+		layers &= ~(LAYER_BIT(excluded_layer_idx) |
+			    kbd->constituent_masks[excluded_layer_idx]);
 
-			for (j = 0; j < excluded_layer->nr_constituents; j++)
-				if ((size_t)excluded_layer->constituents[j] == i)
-					excluded = 1;
-		}
+	while (layers) {
+		int i = highest_layer(layers);
 
-		if (!excluded)
-			mods |= layer->mods;
+		mods |= kbd->config->layers[i].mods;
+		layers &= ~LAYER_BIT(i);
 	}
 
 	set_mods(kbd, mods);
@@ -165,9 +312,13 @@ static uint8_t update_mods(struct keyboard *kbd, int excluded_layer_idx, uint8_t
 	return mods;
 }
 
-static long execute_macro(struct keyboard *kbd, int dl, const struct macro *macro)
+/*
+ * Delays within the macro do not block, the corresponding output (and any
+ * output which follows it) is queued and emitted once it becomes due.
+ */
+static long execute_macro(struct keyboard *kbd, int dl, const struct macro *macro, uint64_t time)
 {
-	long time = 0;
+	long execution_time = 0;
 
 	/* Minimize redundant modifier strokes for simple key sequences. */
 	if (macro->sz == 1 && macro->entries[0].type == MACRO_KEYSEQUENCE) {
@@ -178,71 +329,58 @@ static long execute_macro(struct keyboard *kbd, int dl, const struct macro *macr
 		send_key(kbd, code, 1);
 		send_key(kbd, code, 0);
 	} else {
+		struct macro_ctx ctx = { kbd, time };
+
 		update_mods(kbd, dl, 0);
-		time = macro_execute(send_key_macro_wrapper, kbd, macro, kbd->config.macro_sequence_timeout);
+		execution_time = macro_execute(send_key_macro_wrapper, delay_macro_wrapper, &ctx,
+					       macro, kbd->config->macro_sequence_timeout);
 	}
 
 	update_mods(kbd, -1, 0);
-	return time;
+	return execution_time;
 }
 
-static void lookup_descriptor(struct keyboard *kbd, uint8_t code,
-			      struct descriptor *d, int *dl)
+/* Must be called whenever the layer state or the keymap changes. */
+static void invalidate_keymap_cache(struct keyboard *kbd)
 {
-	size_t max;
-	size_t i;
-
-	d->op = 0;
-
-	long maxts = 0;
-
-	if (code >= KEYD_CHORD_1 && code <= KEYD_CHORD_MAX) {
-		size_t idx = code - KEYD_CHORD_1;
-
-		*d = kbd->active_chords[idx].chord.d;
-		*dl = kbd->active_chords[idx].layer;
-
-		return;
+	/* Generation 0 is never valid. */
+	if (!++kbd->keymap_generation) {
+		memset(kbd->keymap_cache, 0, sizeof kbd->keymap_cache);
+		kbd->keymap_generation = 1;
 	}
+}
 
-	for (i = 0; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
+static void resolve_descriptor(struct keyboard *kbd, uint8_t code,
+			       struct descriptor *d, int *dl)
+{
+	size_t max;
+	uint32_t layers;
 
-		if (kbd->layer_state[i].active) {
-			long activation_time = kbd->layer_state[i].activation_time;
+	d->op = 0;
 
-			if (layer->keymap[code].op && activation_time >= maxts) {
-				maxts = activation_time;
-				*d = layer->keymap[code];
-				*dl = i;
-			}
-		}
+	layers = kbd->active_layers & kbd->keymap_layers[code];
+	if (layers) {
+		*dl = top_layer(kbd, layers);
+		*d = *config_get_keymap(kbd->config, &kbd->overlay, *dl, code);
 	}
 
 	max = 0;
 	/* Scan for any composite matches (which take precedence). */
-	for (i = 0; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
-
-		if (layer->type == LT_COMPOSITE) {
-			size_t j;
-			int match = 1;
-			uint8_t mods = 0;
-
-			for (j = 0; j < layer->nr_constituents; j++) {
-				if (kbd->layer_state[layer->constituents[j]].active)
-					mods |= kbd->config.layers[layer->constituents[j]].mods;
-				else
-					match = 0;
-			}
-
-			if (match && layer->keymap[code].op && (layer->nr_constituents > max)) {
-				*d = layer->keymap[code];
-				*dl = i;
-
-				max = layer->nr_constituents;
-			}
+	layers = kbd->composite_layers & kbd->keymap_layers[code];
+	while (layers) {
+		int i = __builtin_ctz(layers);
+		uint32_t constituents = kbd->constituent_masks[i];
+		struct layer *layer = &kbd->config->layers[i];
+
+		if ((kbd->active_layers & constituents) == constituents &&
+		    layer->nr_constituents > max) {
+			*d = *config_get_keymap(kbd->config, &kbd->overlay, i, code);
+			*dl = i;
+
+			max = layer->nr_constituents;
 		}
+
+		layers &= layers - 1;
 	}
 
 	if (!d->op) {
@@ -253,14 +391,42 @@ static void lookup_descriptor(struct keyboard *kbd, uint8_t code,
 	}
 }
 
+static void lookup_descriptor(struct keyboard *kbd, uint8_t code,
+			      struct descriptor *d, int *dl)
+{
+	struct keymap_cache_entry *ent = &kbd->keymap_cache[code];
+
+	if (code >= KEYD_CHORD_1 && code <= KEYD_CHORD_MAX) {
+		size_t idx = code - KEYD_CHORD_1;
+
+		*d = kbd->active_chords[idx].chord.d;
+		*dl = kbd->active_chords[idx].layer;
+
+		return;
+	}
+
+	if (ent->generation != kbd->keymap_generation) {
+		resolve_descriptor(kbd, code, &ent->d, &ent->dl);
+		ent->generation = kbd->keymap_generation;
+	}
+
+	*d = ent->d;
+	*dl = ent->dl;
+}
+
 static void deactivate_layer(struct keyboard *kbd, int idx)
 {
-	dbg("Deactivating layer %s", kbd->config.layers[idx].name);
+	dbg("Deactivating layer %s", kbd->config->layers[idx].name);
 
 	assert(kbd->layer_state[idx].active > 0);
-	kbd->layer_state[idx].active--;
+	if (!--kbd->layer_state[idx].active) {
+		kbd->active_layers &= ~LAYER_BIT(idx);
+		layer_stack_remove(kbd, idx);
+	}
+
+	invalidate_keymap_cache(kbd);
 
-	kbd->output.on_layer_change(kbd, &kbd->config.layers[idx], 0);
+	kbd->output.on_layer_change(kbd, &kbd->config->layers[idx], 0);
 }
 
 /*
@@ -270,54 +436,25 @@ static void deactivate_layer(struct keyboard *kbd, int idx)
 
 static void activate_layer(struct keyboard *kbd, uint8_t code, int idx)
 {
-	dbg("Activating layer %s", kbd->config.layers[idx].name);
+	dbg("Activating layer %s", kbd->config->layers[idx].name);
 	struct cache_entry *ce;
 
-	kbd->layer_state[idx].activation_time = get_time();
 	kbd->layer_state[idx].active++;
+	kbd->active_layers |= LAYER_BIT(idx);
 
-	if ((ce = cache_get(kbd, code)))
-		ce->layer = idx;
-
-	kbd->output.on_layer_change(kbd, &kbd->config.layers[idx], 1);
-}
-
-/* Returns:
- *  0 on no match
- *  1 on partial match
- *  2 on exact match
- */
-static int chord_event_match(struct chord *chord, struct key_event *events, size_t nevents)
-{
-	size_t i, j;
-	size_t n = 0;
-	size_t npressed = 0;
-
-	if (!nevents)
-		return 0;
-
-	for (i = 0; i < nevents; i++)
-		if (events[i].pressed) {
-			int found = 0;
+	/* (Re)activation moves the layer to the top. */
+	layer_stack_remove(kbd, idx);
+	kbd->layer_stack[kbd->layer_stack_sz++] = idx;
 
-			npressed++;
-			for (j = 0; j < chord->sz; j++)
-				if (chord->keys[j] == events[i].code)
-					found = 1;
+	invalidate_keymap_cache(kbd);
 
-			if (!found)
-				return 0;
-			else
-				n++;
-		}
+	if ((ce = cache_get(kbd, code)))
+		ce->layer = idx;
 
-	if (npressed == 0)
-		return 0;
-	else
-		return n == chord->sz ? 2 : 1;
+	kbd->output.on_layer_change(kbd, &kbd->config->layers[idx], 1);
 }
 
-static void enqueue_chord_event(struct keyboard *kbd, uint8_t code, uint8_t pressed, long time)
+static void enqueue_chord_event(struct keyboard *kbd, uint8_t code, uint8_t pressed, uint64_t time)
 {
 	if (!code)
 		return;
@@ -337,35 +474,95 @@ static void enqueue_chord_event(struct keyboard *kbd, uint8_t code, uint8_t pres
  *  2 in the case of an unambiguous match (populating chord and layer)
  *  3 in the case of an ambiguous match (populating chord and layer)
  */
+/* Returns a bitmask of the overlay chords of the layer which contain every given key. */
+static uint64_t overlay_chord_candidates(struct keyboard *kbd, int layer,
+					 const uint8_t *keys, size_t n)
+{
+	size_t i, j, k;
+	uint64_t candidates = 0;
+
+	if (!kbd->overlay_chords[layer])
+		return 0;
+
+	for (i = 0; i < kbd->overlay.nr_chords; i++) {
+		const struct overlay_chord *oc = &kbd->overlay.chords[i];
+		size_t nm = 0;
+
+		if (oc->layer != layer)
+			continue;
+
+		for (j = 0; j < n; j++)
+			for (k = 0; k < oc->chord.sz; k++)
+				if (keys[j] == oc->chord.keys[k]) {
+					nm++;
+					break;
+				}
+
+		if (nm == n)
+			candidates |= (uint64_t)1 << oc->idx;
+	}
+
+	return candidates;
+}
+
 static int check_chord_match(struct keyboard *kbd, const struct chord **chord, int *chord_layer)
 {
-	size_t idx;
+	size_t i;
 	int full_match = 0;
 	int partial_match = 0;
-	long maxts = -1;
+	uint32_t layers = kbd->active_layers;
 
-	for (idx = 0; idx < kbd->config.nr_layers; idx++) {
-		size_t i;
-		struct layer *layer = &kbd->config.layers[idx];
+	uint8_t pressed[ARRAY_SIZE(kbd->chord.queue)];
+	size_t npressed = 0;
+
+	for (i = 0; i < kbd->chord.queue_sz; i++)
+		if (kbd->chord.queue[i].pressed)
+			pressed[npressed++] = kbd->chord.queue[i].code;
+
+	if (!npressed)
+		return 0;
+
+	/*
+	 * Visit layers in order of precedence, full matches in the topmost
+	 * matching layer win (the last one if there are several).
+	 */
+	while (layers) {
+		int idx = top_layer(kbd, layers);
+		uint64_t candidates = ~0ULL;
+
+		layers &= ~LAYER_BIT(idx);
 
-		if (!kbd->layer_state[idx].active)
+		if (!config_nr_chords(kbd->config, &kbd->overlay, idx))
 			continue;
 
-		for (i = 0; i < layer->nr_chords; i++) {
-			int ret = chord_event_match(&layer->chords[i],
-						    kbd->chord.queue,
-						    kbd->chord.queue_sz);
+		/*
+		 * The chords which contain every pressed key. Chords held in
+		 * the overlay are few, and are checked directly.
+		 */
+		if (kbd->config->chord_index) {
+			for (i = 0; i < npressed && candidates; i++)
+				candidates &= kbd->config->chord_index[idx][pressed[i]];
+		} else {
+			candidates = 0;
+		}
+
+		candidates &= ~kbd->overlay_chords[idx];
+		candidates |= overlay_chord_candidates(kbd, idx, pressed, npressed);
 
-			if (ret == 2 &&
-				maxts <= kbd->layer_state[idx].activation_time) {
-				*chord_layer = (int)idx;
-				*chord = &layer->chords[i];
+		while (candidates) {
+			int n = __builtin_ctzll(candidates);
+			const struct chord *c = config_get_chord(kbd->config, &kbd->overlay, idx, n);
 
-				full_match = 1;
-				maxts = kbd->layer_state[idx].activation_time;
-			} else if (ret == 1) {
+			if (c->sz != npressed) {
 				partial_match = 1;
+			} else if (!full_match || *chord_layer == idx) {
+				*chord_layer = idx;
+				*chord = c;
+
+				full_match = 1;
 			}
+
+			candidates &= candidates - 1;
 		}
 	}
 
@@ -387,14 +584,19 @@ static void execute_command(const char *cmd)
 		wait(NULL);
 		return;
 	}
+
+	/*
+	 * The children must not run the daemon's exit handlers, which would
+	 * flush output still queued for the virtual keyboard a second time.
+	 */
 	if (fork())
-		exit(0);
+		_exit(0);
 
 	fd = open("/dev/null", O_RDWR);
 
 	if (fd < 0) {
 		perror("open");
-		exit(-1);
+		_exit(-1);
 	}
 
 	close(0);
@@ -406,13 +608,14 @@ static void execute_command(const char *cmd)
 	dup2(fd, 2);
 
 	execl("/bin/sh", "/bin/sh", "-c", cmd, NULL);
+	_exit(-1);
 }
 
 static void clear_oneshot(struct keyboard *kbd)
 {
 	size_t i = 0;
 
-	for (i = 0; i < kbd->config.nr_layers; i++)
+	for (i = 0; i < kbd->config->nr_layers; i++)
 		while (kbd->layer_state[i].oneshot_depth) {
 			deactivate_layer(kbd, i);
 			kbd->layer_state[i].oneshot_depth--;
@@ -420,14 +623,15 @@ static void clear_oneshot(struct keyboard *kbd)
 
 	kbd->oneshot_latch = 0;
 	kbd->oneshot_timeout = 0;
+	cancel_timer(kbd, TIMER_ONESHOT);
 }
 
 static void clear(struct keyboard *kbd)
 {
 	size_t i;
 	clear_oneshot(kbd);
-	for (i = 1; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
+	for (i = 1; i < kbd->config->nr_layers; i++) {
+		struct layer *layer = &kbd->config->layers[i];
 
 		if (layer->type != LT_LAYOUT) {
 			if (kbd->layer_state[i].toggled) {
@@ -437,7 +641,8 @@ static void clear(struct keyboard *kbd)
 		}
 	}
 
-	kbd->active_macro = NULL;
+	kbd->active_macro.sz = 0;
+	cancel_timer(kbd, TIMER_MACRO);
 
 	reset_keystate(kbd);
 }
@@ -447,63 +652,64 @@ static void setlayout(struct keyboard *kbd, uint8_t idx)
 	clear(kbd);
 	/* Only only layout may be active at a time, with the exception of main. */
 	size_t i;
-	for (i = 1; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
+	for (i = 1; i < kbd->config->nr_layers; i++) {
+		struct layer *layer = &kbd->config->layers[i];
 
-		if (layer->type == LT_LAYOUT)
+		if (layer->type == LT_LAYOUT) {
 			kbd->layer_state[i].active = 0;
+			kbd->active_layers &= ~LAYER_BIT(i);
+			layer_stack_remove(kbd, i);
+		}
 	}
 
 	// Setting the layout to main is equivalent to clearing all occluding layouts.
 	if (idx != 0) {
-		kbd->layer_state[idx].activation_time = 1;
 		kbd->layer_state[idx].active = 1;
+		kbd->active_layers |= LAYER_BIT(idx);
 	}
 
-	kbd->output.on_layer_change(kbd, &kbd->config.layers[idx], 1);
+	invalidate_keymap_cache(kbd);
+
+	kbd->output.on_layer_change(kbd, &kbd->config->layers[idx], 1);
 }
 
 
-static void schedule_timeout(struct keyboard *kbd, long timeout)
+static uint64_t calculate_main_loop_timeout(struct keyboard *kbd, uint64_t time)
 {
-	assert(kbd->nr_timeouts < ARRAY_SIZE(kbd->timeouts));
-	kbd->timeouts[kbd->nr_timeouts++] = timeout;
-}
+	uint64_t timeout = 0;
+	uint64_t deadline;
 
-static long calculate_main_loop_timeout(struct keyboard *kbd, long time)
-{
-	size_t i;
-	long timeout = 0;
-	size_t n = 0;
+	/* Timers which have been processed. */
+	while (kbd->timers.sz && kbd->timers.heap[0].deadline <= time)
+		cancel_timer(kbd, kbd->timers.heap[0].id);
 
-	for (i = 0; i < kbd->nr_timeouts; i++)
-		if (kbd->timeouts[i] > time) {
-			if (!timeout || kbd->timeouts[i] < timeout)
-				timeout = kbd->timeouts[i];
+	if (kbd->timers.sz)
+		timeout = kbd->timers.heap[0].deadline;
 
-			kbd->timeouts[n++] = kbd->timeouts[i];
-		}
+	deadline = macro_queue_deadline(&kbd->macro_queue);
+	if (deadline && (!timeout || deadline < timeout))
+		timeout = deadline;
 
-	kbd->nr_timeouts = n;
-	return timeout ? timeout - time : 0;
+	return timeout;
 }
 
 static long process_descriptor(struct keyboard *kbd, uint8_t code,
 			       const struct descriptor *d, int dl,
-			       int pressed, long time)
+			       int pressed, uint64_t time)
 {
 	int i;
-	int timeout = 0;
+	long timeout = 0;
+	struct cache_entry *ce;
 
 	if (pressed) {
-		struct macro *macro;
+		struct macro macro;
 
 		switch (d->op) {
 		case OP_LAYERM:
 		case OP_ONESHOTM:
 		case OP_TOGGLEM:
-			macro = &kbd->config.macros[d->args[1].idx];
-			execute_macro(kbd, dl, macro);
+			macro = get_macro(kbd, d->args[1].idx);
+			execute_macro(kbd, dl, &macro, time);
 			break;
 		default:
 			break;
@@ -512,8 +718,8 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 
 	switch (d->op) {
 		int idx;
-		struct macro *macro;
-		struct descriptor *action;
+		struct macro macro;
+		const struct descriptor *action;
 		uint8_t mods;
 		uint8_t new_code;
 		struct pending_timeout *pt;
@@ -570,28 +776,24 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 		break;
 	case OP_OVERLOAD_IDLE_TIMEOUT:
 		if (pressed) {
-			struct descriptor *action;
-			long timeout = d->args[2].timeout;
+			const struct descriptor *action;
+			uint64_t timeout = d->args[2].timeout * 1000;
 
 			if (((time - kbd->last_simple_key_time) >= timeout))
-				action = &kbd->config.descriptors[d->args[1].idx];
+				action = get_descriptor(kbd, d->args[1].idx);
 			else
-				action = &kbd->config.descriptors[d->args[0].idx];
+				action = get_descriptor(kbd, d->args[0].idx);
 
 			process_descriptor(kbd, code, action, dl, 1, time);
-			for (i = 0; i < CACHE_SIZE; i++) {
-				if (code == kbd->cache[i].code) {
-					kbd->cache[i].d = *action;
-					break;
-				}
-			}
+			if ((ce = cache_get(kbd, code)))
+				ce->d = *action;
 		}
 		break;
 	case OP_OVERLOAD_TIMEOUT_TAP:
 	case OP_OVERLOAD_TIMEOUT:
 		if (pressed) {
 			uint8_t layer = d->args[0].idx;
-			struct descriptor *action = &kbd->config.descriptors[d->args[1].idx];
+			const struct descriptor *action = get_descriptor(kbd, d->args[1].idx);
 
 			kbd->pending_overload.code = code;
 			kbd->pending_overload.resolve_on_interrupt = d->op == OP_OVERLOAD_TIMEOUT_TAP;
@@ -600,9 +802,9 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 			kbd->pending_overload.action1 = *action;
 			kbd->pending_overload.action2.op = OP_LAYER;
 			kbd->pending_overload.action2.args[0].idx = layer;
-			kbd->pending_overload.expiration = time + d->args[2].timeout;
+			kbd->pending_overload.expiration = time + d->args[2].timeout * 1000;
 
-			schedule_timeout(kbd, kbd->pending_overload.expiration);
+			set_timer(kbd, TIMER_PENDING_OVERLOAD, kbd->pending_overload.expiration);
 		}
 
 		break;
@@ -633,17 +835,16 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 	case OP_CLEARM:
 		if(pressed) {
 			clear(kbd);
-			macro = &kbd->config.macros[d->args[0].idx];
-			execute_macro(kbd, dl, macro);
+			macro = get_macro(kbd, d->args[0].idx);
+			execute_macro(kbd, dl, &macro, time);
 		}
 		break;
 	case OP_REPEAT:
 		if(pressed) {
 			process_descriptor(kbd, code, &kbd->last_repeatable_action, dl, 1, time);
 
-			for (i = 0; i < CACHE_SIZE; i++)
-				if (kbd->cache[i].code == code)
-					kbd->cache[i].d = kbd->last_repeatable_action;
+			if ((ce = cache_get(kbd, code)))
+				ce->d = kbd->last_repeatable_action;
 		}
 		break;
 	case OP_CLEAR:
@@ -652,7 +853,7 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 		break;
 	case OP_OVERLOAD:
 		idx = d->args[0].idx;
-		action = &kbd->config.descriptors[d->args[1].idx];
+		action = get_descriptor(kbd, d->args[1].idx);
 
 		if (pressed) {
 			kbd->overload_start_time = time;
@@ -663,15 +864,15 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 			update_mods(kbd, -1, 0);
 
 			if (kbd->last_pressed_code == code &&
-			    (!kbd->config.overload_tap_timeout ||
-			     ((time - kbd->overload_start_time) < kbd->config.overload_tap_timeout))) {
+			    (!kbd->config->overload_tap_timeout ||
+			     ((time - kbd->overload_start_time) < kbd->config->overload_tap_timeout * 1000ULL))) {
 				if (action->op == OP_MACRO) {
 					/*
 					 * Macro release relies on event logic, so we can't just synthesize a
 					 * descriptor release.
 					 */
-					struct macro *macro = &kbd->config.macros[action->args[0].idx];
-					execute_macro(kbd, dl, macro);
+					struct macro macro = get_macro(kbd, action->args[0].idx);
+					execute_macro(kbd, dl, &macro, time);
 				} else {
 					process_descriptor(kbd, code, action, dl, 1, time);
 					process_descriptor(kbd, code, action, dl, 0, time);
@@ -687,20 +888,20 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 
 		if (pressed) {
 			if (d->op == OP_ONESHOTK)
-				process_descriptor(kbd, code, &kbd->config.descriptors[d->args[1].idx], dl, 1, time);
+				process_descriptor(kbd, code, get_descriptor(kbd, d->args[1].idx), dl, 1, time);
 
 			activate_layer(kbd, code, idx);
 			update_mods(kbd, dl, 0);
 			kbd->oneshot_latch = 1;
 		} else {
 			if (d->op == OP_ONESHOTK)
-				process_descriptor(kbd, code, &kbd->config.descriptors[d->args[1].idx], dl, 0, time);
+				process_descriptor(kbd, code, get_descriptor(kbd, d->args[1].idx), dl, 0, time);
 
 			if (kbd->oneshot_latch) {
 				kbd->layer_state[idx].oneshot_depth++;
-				if (kbd->config.oneshot_timeout) {
-					kbd->oneshot_timeout = time + kbd->config.oneshot_timeout;
-					schedule_timeout(kbd, kbd->oneshot_timeout);
+				if (kbd->config->oneshot_timeout) {
+					kbd->oneshot_timeout = time + kbd->config->oneshot_timeout * 1000;
+					set_timer(kbd, TIMER_ONESHOT, kbd->oneshot_timeout);
 				}
 			} else {
 				deactivate_layer(kbd, idx);
@@ -715,25 +916,25 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 			long execution_time;
 
 			if (d->op == OP_MACRO2) {
-				macro = &kbd->config.macros[d->args[2].idx];
+				macro = get_macro(kbd, d->args[2].idx);
 
-				timeout = d->args[0].timeout;
-				kbd->macro_repeat_interval = d->args[1].timeout;
+				timeout = d->args[0].timeout * 1000;
+				kbd->macro_repeat_interval = d->args[1].timeout * 1000;
 			} else {
-				macro = &kbd->config.macros[d->args[0].idx];
+				macro = get_macro(kbd, d->args[0].idx);
 
-				timeout = kbd->config.macro_timeout;
-				kbd->macro_repeat_interval = kbd->config.macro_repeat_timeout;
+				timeout = kbd->config->macro_timeout * 1000;
+				kbd->macro_repeat_interval = kbd->config->macro_repeat_timeout * 1000;
 			}
 
 			clear_oneshot(kbd);
 
-			execution_time = execute_macro(kbd, dl, macro);
+			execution_time = execute_macro(kbd, dl, &macro, time);
 			kbd->active_macro = macro;
 			kbd->active_macro_layer = dl;
 
 			kbd->macro_timeout = execution_time + time + timeout;
-			schedule_timeout(kbd, kbd->macro_timeout);
+			set_timer(kbd, TIMER_MACRO, kbd->macro_timeout);
 
 			kbd->last_repeatable_action = *d;
 		}
@@ -763,21 +964,25 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 			pt->code = code;
 			pt->dl = dl;
 
-			pt->action1 = kbd->config.descriptors[d->args[0].idx];
-			pt->expiration = time + d->args[1].timeout;
-			pt->action2 = kbd->config.descriptors[d->args[2].idx];
+			pt->action1 = *get_descriptor(kbd, d->args[0].idx);
+			pt->expiration = time + d->args[1].timeout * 1000;
+			pt->action2 = *get_descriptor(kbd, d->args[2].idx);
 
 			pt->activation_time = time;
 			pt->spontaneous = 0;
 
-			schedule_timeout(kbd, pt->expiration);
+			set_timer(kbd, TIMER_PENDING_TIMEOUT, pt->expiration);
 		} else if (time == kbd->pending_timeout.activation_time) {
 			pt->spontaneous = 1;
 		}
 		break;
 	case OP_COMMAND:
 		if (pressed) {
-			execute_command(kbd->config.commands[d->args[0].idx].cmd);
+			const struct command *cmd = get_command(kbd, d->args[0].idx);
+
+			if (cmd)
+				execute_command(cmd->cmd);
+
 			clear_oneshot(kbd);
 			update_mods(kbd, -1, 0);
 		}
@@ -785,7 +990,9 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 	case OP_SWAP:
 	case OP_SWAPM:
 		idx = d->args[0].idx;
-		macro = d->op == OP_SWAPM ?  &kbd->config.macros[d->args[1].idx] : NULL;
+		macro.sz = 0;
+		if (d->op == OP_SWAPM)
+			macro = get_macro(kbd, d->args[1].idx);
 
 		if (pressed) {
 			size_t i;
@@ -806,12 +1013,11 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 				kbd->layer_state[idx].oneshot_depth++;
 				update_mods(kbd, -1, 0);
 			} else {
-				for (i = 0; i < CACHE_SIZE; i++) {
-					uint8_t code = kbd->cache[i].code;
+				for (i = 0; i < 256; i++) {
 					int layer = kbd->cache[i].layer;
-					int type = kbd->config.layers[layer].type;
+					int type = kbd->config->layers[layer].type;
 
-					if (code && layer == dl && type == LT_NORMAL && layer != 0) {
+					if (cache_get(kbd, i) && layer == dl && type == LT_NORMAL && layer != 0) {
 						ce = &kbd->cache[i];
 						break;
 					}
@@ -828,13 +1034,12 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 				}
 			}
 
-			if (macro)
-				execute_macro(kbd, dl, macro);
+			if (macro.sz)
+				execute_macro(kbd, dl, &macro, time);
 		} else {
-			if (macro &&
-			    macro->sz == 1 &&
-			    macro->entries[0].type == MACRO_KEYSEQUENCE) {
-				uint8_t code = macro->entries[0].data;
+			if (macro.sz == 1 &&
+			    macro.entries[0].type == MACRO_KEYSEQUENCE) {
+				uint8_t code = macro.entries[0].data;
 
 				send_key(kbd, code, 0);
 				update_mods(kbd, -1, 0);
@@ -857,23 +1062,25 @@ struct keyboard *new_keyboard(struct config *config, const struct output *output
 
 	kbd = calloc(1, sizeof(struct keyboard));
 
-	kbd->original_config = config;
-	memcpy(&kbd->config, kbd->original_config, sizeof(struct config));
+	kbd->config = config;
 
 	kbd->output = *output;
 	kbd->layer_state[0].active = 1;
-	kbd->layer_state[0].activation_time = 0;
+	kbd->active_layers = LAYER_BIT(0);
+	kbd->keymap_generation = 1;
+
+	update_layer_masks(kbd);
 
-	if (kbd->config.default_layout[0]) {
+	if (kbd->config->default_layout[0]) {
 		int found = 0;
-		for (i = 0; i < kbd->config.nr_layers; i++) {
-			struct layer *layer = &kbd->config.layers[i];
+		for (i = 0; i < kbd->config->nr_layers; i++) {
+			struct layer *layer = &kbd->config->layers[i];
 
 			if (layer->type == LT_LAYOUT &&
 			    !strcmp(layer->name,
-				    kbd->config.default_layout)) {
+				    kbd->config->default_layout)) {
 				kbd->layer_state[i].active = 1;
-				kbd->layer_state[i].activation_time = 1;
+				kbd->active_layers |= LAYER_BIT(i);
 				found = 1;
 				break;
 			}
@@ -881,7 +1088,7 @@ struct keyboard *new_keyboard(struct config *config, const struct output *output
 
 		if (!found)
 			keyd_log("\tWARNING: could not find default layout %s.\n",
-				kbd->config.default_layout);
+				kbd->config->default_layout);
 	}
 
 	kbd->chord.queue_sz = 0;
@@ -896,6 +1103,7 @@ static int resolve_chord(struct keyboard *kbd)
 	const struct chord *chord = kbd->chord.match;
 
 	kbd->chord.state = CHORD_RESOLVING;
+	cancel_timer(kbd, TIMER_CHORD);
 
 	if (chord) {
 		size_t i;
@@ -934,11 +1142,11 @@ static int abort_chord(struct keyboard *kbd)
 }
 
 static int handle_chord(struct keyboard *kbd,
-			uint8_t code, int pressed, long time)
+			uint8_t code, int pressed, uint64_t time)
 {
 	size_t i;
-	const long interkey_timeout = kbd->config.chord_interkey_timeout;
-	const long hold_timeout = kbd->config.chord_hold_timeout;
+	const uint64_t interkey_timeout = kbd->config->chord_interkey_timeout * 1000ULL;
+	const uint64_t hold_timeout = kbd->config->chord_hold_timeout * 1000ULL;
 
 	if (code && !pressed) {
 		for (i = 0; i < ARRAY_SIZE(kbd->active_chords); i++) {
@@ -988,7 +1196,7 @@ static int handle_chord(struct keyboard *kbd,
 			case 1:
 				kbd->chord.state = CHORD_PENDING_DISAMBIGUATION;
 				kbd->chord.last_code_time = time;
-				schedule_timeout(kbd, time + interkey_timeout);
+				set_timer(kbd, TIMER_CHORD, time + interkey_timeout);
 				return 1;
 			default:
 			case 2:
@@ -996,7 +1204,7 @@ static int handle_chord(struct keyboard *kbd,
 
 				if (hold_timeout) {
 					kbd->chord.state = CHORD_PENDING_HOLD_TIMEOUT;
-					schedule_timeout(kbd, time + hold_timeout);
+					set_timer(kbd, TIMER_CHORD, time + hold_timeout);
 				} else {
 					return resolve_chord(kbd);
 				}
@@ -1006,9 +1214,10 @@ static int handle_chord(struct keyboard *kbd,
 		if (!code) {
 			if ((time - kbd->chord.last_code_time) >= interkey_timeout) {
 				if (kbd->chord.match) {
-					long timeleft = hold_timeout - interkey_timeout;
-					if (timeleft > 0) {
-						schedule_timeout(kbd, time + timeleft);
+					if (hold_timeout > interkey_timeout) {
+						uint64_t timeleft = hold_timeout - interkey_timeout;
+
+						set_timer(kbd, TIMER_CHORD, time + timeleft);
 						kbd->chord.state = CHORD_PENDING_HOLD_TIMEOUT;
 					} else {
 						return resolve_chord(kbd);
@@ -1036,7 +1245,7 @@ static int handle_chord(struct keyboard *kbd,
 				kbd->chord.last_code_time = time;
 
 				kbd->chord.state = CHORD_PENDING_DISAMBIGUATION;
-				schedule_timeout(kbd, time + interkey_timeout);
+				set_timer(kbd, TIMER_CHORD, time + interkey_timeout);
 				return 1;
 			default:
 			case 2:
@@ -1044,7 +1253,7 @@ static int handle_chord(struct keyboard *kbd,
 
 				if (hold_timeout) {
 					kbd->chord.state = CHORD_PENDING_HOLD_TIMEOUT;
-					schedule_timeout(kbd, time + hold_timeout);
+					set_timer(kbd, TIMER_CHORD, time + hold_timeout);
 				} else {
 					return resolve_chord(kbd);
 				}
@@ -1074,7 +1283,7 @@ static int handle_chord(struct keyboard *kbd,
 	return 0;
 }
 
-int handle_pending_timeout(struct keyboard *kbd, uint8_t event_code, int pressed, long time)
+int handle_pending_timeout(struct keyboard *kbd, uint8_t event_code, int pressed, uint64_t time)
 {
 	struct pending_timeout pt = kbd->pending_timeout;
 
@@ -1085,6 +1294,7 @@ int handle_pending_timeout(struct keyboard *kbd, uint8_t event_code, int pressed
 		if ((time >= pt.expiration) || event_code) {
 			struct descriptor action = time >= pt.expiration ? pt.action2 : pt.action1;
 			kbd->pending_timeout.code = 0;
+			cancel_timer(kbd, TIMER_PENDING_TIMEOUT);
 
 			process_descriptor(kbd, pt.code, &action, pt.dl, 1, time);
 			process_descriptor(kbd, pt.code, &action, pt.dl, 0, time);
@@ -1092,6 +1302,7 @@ int handle_pending_timeout(struct keyboard *kbd, uint8_t event_code, int pressed
 	} else if (time >= pt.expiration || (event_code && (pressed || event_code == pt.code))) {
 		struct descriptor action = time >= pt.expiration ? pt.action2 : pt.action1;
 		kbd->pending_timeout.code = 0;
+		cancel_timer(kbd, TIMER_PENDING_TIMEOUT);
 
 		cache_set(kbd, pt.code, &(struct cache_entry){
 			.code = pt.code,
@@ -1104,7 +1315,7 @@ int handle_pending_timeout(struct keyboard *kbd, uint8_t event_code, int pressed
 	return 0;
 }
 
-int handle_pending_overload(struct keyboard *kbd, uint8_t code, int pressed, long time)
+int handle_pending_overload(struct keyboard *kbd, uint8_t code, int pressed, uint64_t time)
 {
 	struct descriptor action;
 
@@ -1159,6 +1370,7 @@ int handle_pending_overload(struct keyboard *kbd, uint8_t code, int pressed, lon
 		memcpy(queue, kbd->pending_overload.queue, sizeof kbd->pending_overload.queue);
 
 		kbd->pending_overload.code = 0;
+		cancel_timer(kbd, TIMER_PENDING_OVERLOAD);
 		kbd->pending_overload.queue_sz = 0;
 
 		cache_set(kbd, code, &(struct cache_entry) {
@@ -1178,15 +1390,16 @@ int handle_pending_overload(struct keyboard *kbd, uint8_t code, int pressed, lon
 /*
  * `code` may be 0 in the event of a timeout.
  *
- * The return value corresponds to a timeout before which the next invocation
- * of process_event must take place. A return value of 0 permits the
- * main loop to call at liberty.
+ * The return value corresponds to the time (in microseconds) at which the
+ * next timeout must be processed, or 0 if no timeout is pending.
  */
-static long process_event(struct keyboard *kbd, uint8_t code, int pressed, long time)
+static uint64_t process_event(struct keyboard *kbd, uint8_t code, int pressed, uint64_t time)
 {
 	int dl = -1;
 	struct descriptor d;
 
+	macro_queue_drain(&kbd->macro_queue, time, output_key, kbd);
+
 	if (handle_chord(kbd, code, pressed, time))
 		goto exit;
 
@@ -1201,15 +1414,16 @@ static long process_event(struct keyboard *kbd, uint8_t code, int pressed, long
 		update_mods(kbd, -1, 0);
 	}
 
-	if (kbd->active_macro) {
+	if (kbd->active_macro.sz) {
 		if (code) {
-			kbd->active_macro = NULL;
+			kbd->active_macro.sz = 0;
+			cancel_timer(kbd, TIMER_MACRO);
 			update_mods(kbd, -1, 0);
 		} else if (time >= kbd->macro_timeout) {
-			long execution_time = execute_macro(kbd, kbd->active_macro_layer, kbd->active_macro);
+			long execution_time = execute_macro(kbd, kbd->active_macro_layer, &kbd->active_macro, time);
 
 			kbd->macro_timeout = execution_time + time + kbd->macro_repeat_interval;
-			schedule_timeout(kbd, kbd->macro_timeout);
+			set_timer(kbd, TIMER_MACRO, kbd->macro_timeout);
 		}
 	}
 
@@ -1229,8 +1443,7 @@ static long process_event(struct keyboard *kbd, uint8_t code, int pressed, long
 
 			lookup_descriptor(kbd, code, &d, &dl);
 
-			if (cache_set(kbd, code, &(struct cache_entry) { .d = d, .dl = dl, .layer = 0 }))
-				goto exit;
+			cache_set(kbd, code, &(struct cache_entry) { .d = d, .dl = dl, .layer = 0 });
 		} else {
 			struct cache_entry *ce;
 			if (!(ce = cache_get(kbd, code)))
@@ -1251,34 +1464,110 @@ exit:
 }
 
 
-long kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n)
+void kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n)
 {
 	size_t i = 0;
-	int timeout = 0;
-	int timeout_ts = 0;
+	/*
+	 * Timeouts which expired before the first event are processed at
+	 * their scheduled time, even if the caller did not get a chance to
+	 * deliver them yet.
+	 */
+	uint64_t deadline = calculate_main_loop_timeout(kbd, 0);
 
 	while (i != n) {
 		const struct key_event *ev = &events[i];
 
-		if (timeout > 0 && timeout_ts <= ev->timestamp) {
-			timeout = process_event(kbd, 0, 0, timeout_ts);
-			timeout_ts = timeout_ts + timeout;
+		if (deadline && deadline <= ev->timestamp) {
+			deadline = process_event(kbd, 0, 0, deadline);
 		} else {
-			timeout = process_event(kbd, ev->code, ev->pressed, ev->timestamp);
-			timeout_ts = ev->timestamp + timeout;
+			deadline = process_event(kbd, ev->code, ev->pressed, ev->timestamp);
 			i++;
 		}
 	}
 
-	return timeout;
+	if (kbd->output.set_timeout)
+		kbd->output.set_timeout(kbd, deadline);
+}
+
+/*
+ * Processes the key events of a single input frame (at most MAX_FRAME_EVENTS).
+ *
+ * Keys which transition within the same frame are, as far as the hardware
+ * is concerned, simultaneous. In order to make the result independent of the
+ * order in which the kernel happens to serialize them, releases are processed
+ * before presses (unless the frame contains more than one transition for a
+ * given key, in which case the original order is significant).
+ */
+void kbd_process_frame(struct keyboard *kbd, const struct key_event *events, size_t n)
+{
+	size_t i;
+	size_t sz = 0;
+	uint8_t seen[256] = {0};
+	struct key_event ordered[MAX_FRAME_EVENTS];
+
+	assert(n <= MAX_FRAME_EVENTS);
+
+	for (i = 0; i < n; i++) {
+		if (seen[events[i].code]++) {
+			kbd_process_events(kbd, events, n);
+			return;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		if (!events[i].pressed)
+			ordered[sz++] = events[i];
+
+	for (i = 0; i < n; i++)
+		if (events[i].pressed)
+			ordered[sz++] = events[i];
+
+	kbd_process_events(kbd, ordered, sz);
 }
 
 int kbd_eval(struct keyboard *kbd, const char *exp)
 {
-	if (!strcmp(exp, "reset")) {
-		memcpy(&kbd->config, kbd->original_config, sizeof(struct config));
-		return 0;
-	} else {
-		return config_add_entry(&kbd->config, exp);
+	int ret = 0;
+
+	/* Refers to storage which may be invalidated below. */
+	kbd->active_macro.sz = 0;
+	cancel_timer(kbd, TIMER_MACRO);
+
+	/*
+	 * Likewise for a pending chord match, which may point into the
+	 * overlay. The pending keys are then resolved individually.
+	 */
+	kbd->chord.match = NULL;
+
+	if (!strcmp(exp, "reset"))
+		config_overlay_reset(&kbd->overlay);
+	else
+		ret = config_add_binding(kbd->config, &kbd->overlay, exp);
+
+	update_layer_masks(kbd);
+	invalidate_keymap_cache(kbd);
+
+	return ret;
+}
+
+/*
+ * Flushes any pending macro output and releases all keys held on behalf of
+ * the keyboard, leaving the output in a clean state before the keyboard is
+ * discarded.
+ */
+void kbd_reset(struct keyboard *kbd)
+{
+	size_t i;
+
+	macro_queue_drain(&kbd->macro_queue, UINT64_MAX, output_key, kbd);
+
+	for (i = 0; i < 256; i++) {
+		if (kbd->keystate[i]) {
+			output_key(kbd, i, 0);
+			kbd->keystate[i] = 0;
+		}
 	}
+
+	if (kbd->output.set_timeout)
+		kbd->output.set_timeout(kbd, 0);
 }
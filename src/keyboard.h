@@ -12,11 +12,21 @@
 #include "config.h"
 #include "device.h"
 
-#define MAX_ACTIVE_KEYS	32
-#define CACHE_SIZE	16 //Effectively nkro
+#define MAX_FRAME_EVENTS	64
 
 struct keyboard;
 
+/* Each state which can expire has a single timer. */
+enum timer_id {
+	TIMER_CHORD,
+	TIMER_PENDING_TIMEOUT,
+	TIMER_PENDING_OVERLOAD,
+	TIMER_ONESHOT,
+	TIMER_MACRO,
+
+	NR_TIMERS,
+};
+
 struct cache_entry {
 	uint8_t code;
 	struct descriptor d;
@@ -27,25 +37,52 @@ struct cache_entry {
 struct key_event {
 	uint8_t code;
 	uint8_t pressed;
-	int timestamp;
+
+	/* In microseconds. */
+	uint64_t timestamp;
 };
 
 struct output {
 	void (*send_key) (uint8_t code, uint8_t state);
 	void (*on_layer_change) (const struct keyboard *kbd, const struct layer *layer, uint8_t active);
+
+	/*
+	 * Optional, arms the keyboard timer (replacing any existing
+	 * deadline) or cancels it if time is 0. Once the given time (in
+	 * microseconds) has passed, kbd_process_events() should be called
+	 * with a timeout event (code 0).
+	 */
+	void (*set_timeout) (const struct keyboard *kbd, uint64_t time);
 };
 
 /* May correspond to more than one physical input device. */
 struct keyboard {
-	const struct config *original_config;
-	struct config config;
+	/* Shared between keyboards, runtime bindings live in the overlay. */
+	struct config *config;
+	struct config_overlay overlay;
 	struct output output;
 
 	/*
 	 * Cache descriptors to preserve code->descriptor
 	 * mappings in the event of mid-stroke layer changes.
+	 * Indexed by code, cache_occupied records which
+	 * entries are in use.
+	 */
+	struct cache_entry cache[256];
+	uint64_t cache_occupied[4];
+
+	/*
+	 * Memoized results of descriptor lookups for the current layer state.
+	 * An entry is only valid if its generation matches keymap_generation,
+	 * which is bumped whenever the layer state or keymap changes.
 	 */
-	struct cache_entry cache[CACHE_SIZE];
+	struct keymap_cache_entry {
+		struct descriptor d;
+		int dl;
+		uint32_t generation;
+	} keymap_cache[256];
+
+	uint32_t keymap_generation;
 
 	uint8_t last_pressed_output_code;
 	uint8_t last_pressed_code;
@@ -54,21 +91,35 @@ struct keyboard {
 
 	uint8_t inhibit_modifier_guard;
 
-	struct macro *active_macro;
+	/* Output which is held back by a macro delay. */
+	struct macro_queue macro_queue;
+
+	struct macro active_macro;
 	int active_macro_layer;
 	int overload_last_layer_code;
 
-	long macro_timeout;
-	long oneshot_timeout;
+	uint64_t macro_timeout;
+	uint64_t oneshot_timeout;
 
-	long macro_repeat_interval;
+	uint64_t macro_repeat_interval;
 
-	long overload_start_time;
+	uint64_t overload_start_time;
 
-	long last_simple_key_time;
+	uint64_t last_simple_key_time;
 
-	long timeouts[128];
-	size_t nr_timeouts; 
+	/*
+	 * Pending deadlines, kept in a binary min-heap. pos records the
+	 * (1 based) heap position of each timer, or 0 if it is not armed.
+	 */
+	struct {
+		struct timer {
+			uint64_t deadline;
+			uint8_t id;
+		} heap[NR_TIMERS];
+
+		size_t sz;
+		size_t pos[NR_TIMERS];
+	} timers;
 
 	struct active_chord {
 		uint8_t active;
@@ -84,7 +135,7 @@ struct keyboard {
 		int match_layer;
 
 		uint8_t start_code;
-		long last_code_time;
+		uint64_t last_code_time;
 
 		enum {
 			CHORD_RESOLVING,
@@ -99,8 +150,8 @@ struct keyboard {
 		uint8_t dl;
 		uint8_t spontaneous;
 
-		long expiration;
-		long activation_time;
+		uint64_t expiration;
+		uint64_t activation_time;
 
 		struct descriptor action1;
 		struct descriptor action2;
@@ -109,7 +160,7 @@ struct keyboard {
 	struct pending_overload {
 		uint8_t code;
 		uint8_t dl;
-		long expiration;
+		uint64_t expiration;
 
 		int resolve_on_interrupt;
 
@@ -121,13 +172,30 @@ struct keyboard {
 	} pending_overload;
 
 	struct {
-		long activation_time;
-
 		uint8_t active;
 		uint8_t toggled;
 		uint8_t oneshot_depth;
 	} layer_state[MAX_LAYERS];
 
+	/* Bit i is set iff layer_state[i].active is non zero. */
+	uint32_t active_layers;
+
+	/*
+	 * Layers activated by activate_layer() in order of activation (most
+	 * recent last). These take precedence over the active layout, which
+	 * in turn takes precedence over main.
+	 */
+	uint8_t layer_stack[MAX_LAYERS];
+	size_t layer_stack_sz;
+
+	/* Derived from the config by update_layer_masks(). */
+	uint32_t keymap_layers[256]; /* The layers which bind each key. */
+	uint32_t composite_layers;
+	uint32_t constituent_masks[MAX_LAYERS];
+
+	/* For each layer, a bitmask of the chords (by number) held in the overlay. */
+	uint64_t overlay_chords[MAX_LAYERS];
+
 	struct descriptor last_repeatable_action;
 
 	uint8_t keystate[256];
@@ -143,7 +211,8 @@ struct keyboard {
 
 struct keyboard *new_keyboard(struct config *config, const struct output *output);
 
-long kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n);
+void kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n);
+void kbd_process_frame(struct keyboard *kbd, const struct key_event *events, size_t n);
 int kbd_eval(struct keyboard *kbd, const char *exp);
 void kbd_reset(struct keyboard *kbd);
 
@@ -50,6 +50,7 @@ static int help(int argc, char *argv[])
 	       "Commands:\n"
 	       "    monitor [-t]                   Print key events in real time.\n"
 	       "    check [<config file>...]       Check the supplied config files for errors. If no files are supplied, all .conf files in the config directory will be checked.\n"
+	       "    compile [<config file>...]     Precompile the supplied config files (or all .conf files in the config directory) into images which are loaded in place of the text.\n"
 	       "    list-keys                      Print a list of valid key names.\n"
 	       "    reload                         Trigger a reload .\n"
 	       "    listen                         Print layer state changes of the running keyd daemon to stdout.\n"
@@ -221,6 +222,7 @@ struct {
 	{"version", "-v", "--version", version},
 
 	{"check", "-c", "--check", check},
+	{"compile", "", "", compile},
 	/* Keep -e and -m for backward compatibility. TODO: remove these at some point. */
 	{"monitor", "-m", "--monitor", monitor},
 	{"bind", "-e", "--expression", add_bindings},
@@ -69,7 +69,8 @@ struct event {
 	enum event_type type;
 	struct device *dev;
 	struct device_event *devev;
-	int timestamp;
+	/* CLOCK_MONOTONIC time in microseconds. */
+	uint64_t timestamp;
 	int fd;
 };
 
@@ -91,11 +92,15 @@ struct ipc_message {
 };
 
 int check(int argc, char *argv[]);
+int compile(int argc, char *argv[]);
 int monitor(int argc, char *argv[]);
 int run_daemon(int argc, char *argv[]);
 
 void evloop_add_fd(int fd);
-int evloop(int (*event_handler) (struct event *ev));
+void evloop_add_output_fd(int fd);
+void evloop_remove_fd(int fd);
+void evloop_set_timeout(uint64_t time);
+int evloop(void (*event_handler) (struct event *ev));
 
 void xwrite(int fd, const void *buf, size_t sz);
 void xread(int fd, void *buf, size_t sz);
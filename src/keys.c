@@ -269,6 +269,125 @@ const struct keycode_table_ent keycode_table[256] = {
 	[KEYD_NOOP] = { "noop", NULL, NULL },
 };
 
+/*
+ * An open addressing hash table over all key names, alt names and shifted
+ * names, built at startup. Each name records the first code for which it
+ * is a name (or alt name) and the first code for which it is a shifted
+ * name, so that lookups resolve ambiguities exactly as a scan of
+ * keycode_table would.
+ */
+#define NAME_TABLE_SZ 1024
+
+static struct name_ent {
+	const char *name;
+	uint8_t code;
+	uint8_t shifted_code;
+} name_table[NAME_TABLE_SZ];
+
+/* The key (and modifiers) which produce each ASCII character on a US layout. */
+static struct char_ent {
+	uint8_t code;
+	uint8_t mods;
+} char_table[128];
+
+static uint32_t hash_name(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	while (*s) {
+		h ^= (uint8_t)*s++;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+static struct name_ent *name_slot(const char *name)
+{
+	uint32_t i = hash_name(name) % NAME_TABLE_SZ;
+
+	while (name_table[i].name && strcmp(name_table[i].name, name))
+		i = (i + 1) % NAME_TABLE_SZ;
+
+	return &name_table[i];
+}
+
+static void add_name(const char *name, uint8_t code, int shifted)
+{
+	struct name_ent *ent;
+
+	if (!name)
+		return;
+
+	ent = name_slot(name);
+	ent->name = name;
+
+	if (shifted && !ent->shifted_code)
+		ent->shifted_code = code;
+	else if (!shifted && !ent->code)
+		ent->code = code;
+}
+
+static void add_char(const char *name, uint8_t code, uint8_t mods)
+{
+	struct char_ent *ent;
+
+	if (!name || !name[0] || name[1] || (uint8_t)name[0] >= 128)
+		return;
+
+	ent = &char_table[(uint8_t)name[0]];
+	if (!ent->code) {
+		ent->code = code;
+		ent->mods = mods;
+	}
+}
+
+static void __attribute__((constructor)) init_name_table(void)
+{
+	size_t i;
+
+	for (i = 0; i < 256; i++) {
+		const struct keycode_table_ent *ent = &keycode_table[i];
+
+		if (ent->name) {
+			add_name(ent->name, i, 0);
+			add_name(ent->alt_name, i, 0);
+			add_name(ent->shifted_name, i, 1);
+
+			add_char(ent->shifted_name, i, MOD_SHIFT);
+			add_char(ent->name, i, 0);
+			add_char(ent->alt_name, i, 0);
+		}
+	}
+}
+
+/*
+ * Looks up the key and modifiers which produce the given character on a US
+ * layout. Returns -1 if the character cannot be typed directly.
+ */
+int lookup_char(uint32_t codepoint, uint8_t *code, uint8_t *mods)
+{
+	if (codepoint >= 128 || !char_table[codepoint].code)
+		return -1;
+
+	*code = char_table[codepoint].code;
+	*mods = char_table[codepoint].mods;
+
+	return 0;
+}
+
+/*
+ * Looks up the first key with the given name (or alt name) and the first key
+ * with the given shifted name. Either code is 0 if there is no such key.
+ */
+void lookup_key_name(const char *name, uint8_t *code, uint8_t *shifted_code)
+{
+	const struct name_ent *ent = name_slot(name);
+
+	*code = ent->code;
+	*shifted_code = ent->shifted_code;
+}
+
 const char *modstring(uint8_t mods)
 {
 	static char s[16];
@@ -346,7 +465,7 @@ int parse_modset(const char *s, uint8_t *mods)
 int parse_key_sequence(const char *s, uint8_t *codep, uint8_t *modsp)
 {
 	const char *c = s;
-	size_t i;
+	uint8_t code, shifted_code;
 
 	if (!*s)
 		return -1;
@@ -378,36 +497,22 @@ int parse_key_sequence(const char *s, uint8_t *codep, uint8_t *modsp)
 		c += 2;
 	}
 
-	for (i = 0; i < 256; i++) {
-		const struct keycode_table_ent *ent = &keycode_table[i];
-
-		if (ent->name) {
-			if (ent->shifted_name &&
-			    !strcmp(ent->shifted_name, c)) {
-
-				mods |= MOD_SHIFT;
+	lookup_key_name(c, &code, &shifted_code);
 
-				if (modsp)
-					*modsp = mods;
-
-				if (codep)
-					*codep = i;
-
-				return 0;
-			} else if (!strcmp(ent->name, c) ||
-				   (ent->alt_name && !strcmp(ent->alt_name, c))) {
-
-				if (modsp)
-					*modsp = mods;
+	/* A shifted name takes precedence over names of the same key. */
+	if (shifted_code && (!code || shifted_code <= code)) {
+		mods |= MOD_SHIFT;
+		code = shifted_code;
+	} else if (!code) {
+		return -1;
+	}
 
-				if (codep)
-					*codep = i;
+	if (modsp)
+		*modsp = mods;
 
-				return 0;
-			}
-		}
-	}
+	if (codep)
+		*codep = code;
 
-	return -1;
+	return 0;
 }
 
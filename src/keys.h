@@ -292,6 +292,8 @@ struct modifier {
 
 int parse_modset(const char *s, uint8_t *mods);
 int parse_key_sequence(const char *s, uint8_t *code, uint8_t *mods);
+void lookup_key_name(const char *name, uint8_t *code, uint8_t *shifted_code);
+int lookup_char(uint32_t codepoint, uint8_t *code, uint8_t *mods);
 
 extern const struct modifier modifiers[MAX_MOD];
 extern const struct keycode_table_ent keycode_table[256];
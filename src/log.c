@@ -6,6 +6,46 @@
 #include "log.h"
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+/*
+ * Once the writer thread has been started, log records are formatted into
+ * a bounded lock-free (multi-producer, single-consumer) ring and written out
+ * by a low priority thread, so that logging never blocks on (or takes locks
+ * shared with) stdout. Records which do not fit into the ring are dropped
+ * and accounted for by the writer.
+ *
+ * Note that only the write is deferred: the format string is colorized and
+ * expanded by the caller (which may be the real time thread), since the
+ * arguments (e.g layer names) need not outlive the call. Logging therefore
+ * still costs a vsnprintf() on the calling thread and should be kept off
+ * hot paths, which is what the call site level check in dbg() is for.
+ */
+#define LOG_RING_SZ 128 /* Must be a power of two. */
+#define LOG_RECORD_SZ 512
+
+static struct log_record {
+	/* Equal to the claiming position + 1 once the record is ready. */
+	atomic_size_t seq;
+
+	size_t sz;
+	char data[LOG_RECORD_SZ];
+} *ring;
+
+static atomic_size_t ring_head;
+static size_t ring_tail;
+
+static atomic_size_t nr_dropped;
+static atomic_int writer_idle;
+static atomic_int writer_stopping;
+static int wakefd[2];
+
+static pthread_t writer;
+static int async = 0;
 
 char errstr[2048];
 
@@ -14,15 +54,14 @@ static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
 int log_level = 0;
 int suppress_colours = 0;
 
-static const char *colorize(const char *s)
+static const char *colorize(const char *s, char *buf, size_t buf_sz)
 {
 	int i;
 
-	static char buf[1024];
 	size_t n  = 0;
 	int inside_escape = 0;
 
-	for (i = 0; s[i] != 0 && n < sizeof(buf); i++) {
+	for (i = 0; s[i] != 0 && n < buf_sz - 1; i++) {
 		if (s[i+1] == '{') {
 			int escape_num = 0;
 
@@ -38,7 +77,7 @@ static const char *colorize(const char *s)
 			}
 
 			if (escape_num) {
-				if (!suppress_colours && (sizeof(buf)-n > 5)) {
+				if (!suppress_colours && (buf_sz-n > 6)) {
 					buf[n++] = '\033';
 					buf[n++] = '[';
 					buf[n++] = '3';
@@ -54,7 +93,7 @@ static const char *colorize(const char *s)
 		}
 
 		if (s[i] == '}' && inside_escape) {
-			if (!suppress_colours && (sizeof(buf)-n > 4)) {
+			if (!suppress_colours && (buf_sz-n > 5)) {
 				memcpy(buf+n, "\033[0m", 4);
 				n += 4;
 			}
@@ -72,21 +111,179 @@ static const char *colorize(const char *s)
 }
 
 void die(const char *fmt, ...) {
-	fprintf(stderr, "%s", colorize("r{FATAL ERROR:} "));
+	char buf[1024];
+
+	fprintf(stderr, "%s", colorize("r{FATAL ERROR:} ", buf, sizeof buf));
 
 	va_list ap;
 	va_start(ap, fmt);
-	vfprintf(stderr, colorize(fmt), ap);
+	vfprintf(stderr, colorize(fmt, buf, sizeof buf), ap);
 	va_end(ap);
 	fprintf(stderr, "\n");
 
 	exit(-1);
 }
 
+static void wake_writer(void)
+{
+	/* Fails with EAGAIN if plenty of wakeups are already pending. */
+	if (write(wakefd[1], "", 1) < 0)
+		return;
+}
+
+/* Returns -1 if the ring is full. */
+static int ring_push(const char *fmt, va_list ap)
+{
+	int n;
+	size_t pos = atomic_load(&ring_head);
+	struct log_record *rec;
+
+	while (1) {
+		rec = &ring[pos % LOG_RING_SZ];
+		size_t seq = atomic_load(&rec->seq);
+
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak(&ring_head, &pos, pos + 1))
+				break;
+		} else if (seq < pos) {
+			return -1;
+		} else {
+			pos = atomic_load(&ring_head);
+		}
+	}
+
+	n = vsnprintf(rec->data, sizeof rec->data, fmt, ap);
+
+	if (n < 0) {
+		n = 0;
+	} else if ((size_t)n >= sizeof rec->data) {
+		n = sizeof rec->data - 1;
+		rec->data[n-1] = '\n';
+	}
+
+	rec->sz = n;
+	atomic_store(&rec->seq, pos + 1);
+
+	if (atomic_exchange(&writer_idle, 0))
+		wake_writer();
+
+	return 0;
+}
+
+/* Returns 0 if the ring was empty. */
+static int ring_drain(void)
+{
+	int n = 0;
+	size_t dropped;
+
+	while (1) {
+		struct log_record *rec = &ring[ring_tail % LOG_RING_SZ];
+
+		if (atomic_load(&rec->seq) != ring_tail + 1)
+			break;
+
+		fwrite(rec->data, 1, rec->sz, stdout);
+
+		atomic_store(&rec->seq, ring_tail + LOG_RING_SZ);
+		ring_tail++;
+		n++;
+	}
+
+	if ((dropped = atomic_exchange(&nr_dropped, 0))) {
+		char buf[128];
+
+		printf(colorize("y{WARNING:} %zu log messages dropped\n", buf, sizeof buf), dropped);
+	}
+
+	if (n)
+		fflush(stdout);
+
+	return n;
+}
+
+static void *writer_thread(void *arg)
+{
+	char c;
+
+	while (1) {
+		ring_drain();
+
+		if (atomic_load(&writer_stopping)) {
+			ring_drain();
+			return NULL;
+		}
+
+		/*
+		 * Producers only signal the pipe once they observe the
+		 * flag, so the ring must be rechecked after setting it.
+		 */
+		atomic_store(&writer_idle, 1);
+		if (!ring_drain())
+			while (read(wakefd[0], &c, 1) < 0 && errno == EINTR)
+				;
+		atomic_store(&writer_idle, 0);
+	}
+}
+
+static void stop_writer(void)
+{
+	async = 0;
+
+	atomic_store(&writer_stopping, 1);
+	wake_writer();
+
+	pthread_join(writer, NULL);
+}
+
+/*
+ * Moves log output to a dedicated thread. The thread runs under the default
+ * scheduling policy, even if the caller is subsequently made real time.
+ */
+void log_start_writer(void)
+{
+	size_t i;
+	pthread_attr_t attr;
+	struct sched_param sp = {0};
+
+	ring = calloc(LOG_RING_SZ, sizeof(struct log_record));
+	for (i = 0; i < LOG_RING_SZ; i++)
+		atomic_init(&ring[i].seq, i);
+
+	if (pipe(wakefd)) {
+		perror("pipe");
+		exit(-1);
+	}
+
+	fcntl(wakefd[1], F_SETFL, O_NONBLOCK);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &sp);
+
+	if (pthread_create(&writer, &attr, writer_thread, NULL)) {
+		perror("pthread_create");
+		exit(-1);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	async = 1;
+	atexit(stop_writer);
+}
+
 void _vkeyd_log(const char *fmt, va_list ap)
 {
+	char buf[1024];
+
+	if (async) {
+		if (ring_push(colorize(fmt, buf, sizeof buf), ap) < 0)
+			atomic_fetch_add(&nr_dropped, 1);
+		return;
+	}
+
 	pthread_mutex_lock(&mtx);
-	vprintf(colorize(fmt), ap);
+	vprintf(colorize(fmt, buf, sizeof buf), ap);
 	pthread_mutex_unlock(&mtx);
 }
 
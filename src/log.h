@@ -13,14 +13,25 @@
 
 #define keyd_log(fmt, ...) _keyd_log(0, fmt, ##__VA_ARGS__);
 
-#define dbg(fmt, ...) _keyd_log(1, "r{DEBUG:} b{%s:%d:} "fmt"\n", __FILE__, __LINE__, ##__VA_ARGS__)
-#define dbg2(fmt, ...) _keyd_log(2, "r{DEBUG:} b{%s:%d:} "fmt"\n", __FILE__, __LINE__, ##__VA_ARGS__)
+/*
+ * The level is checked at the call site so that the arguments of disabled
+ * debug statements (e.g KEY_NAME()) are never evaluated.
+ */
+#define dbg_level(level, fmt, ...) \
+	do { \
+		if (__builtin_expect(log_level >= level, 0)) \
+			_keyd_log(level, "r{DEBUG:} b{%s:%d:} "fmt"\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+	} while (0)
+
+#define dbg(fmt, ...) dbg_level(1, fmt, ##__VA_ARGS__)
+#define dbg2(fmt, ...) dbg_level(2, fmt, ##__VA_ARGS__)
 
 #define err(fmt, ...) snprintf(errstr, sizeof(errstr), fmt, ##__VA_ARGS__);
 
 void _keyd_log(int level, const char *fmt, ...);
 void _vkeyd_log(const char *fmt, va_list ap);
 void die(const char *fmt, ...);
+void log_start_writer(void);
 
 extern int log_level;
 extern int suppress_colours;
@@ -1,25 +1,34 @@
 #include "keyd.h"
 
+static void arena_push(struct macro_arena *arena, uint8_t type, uint16_t data)
+{
+	if (arena->sz == arena->capacity) {
+		arena->capacity = arena->capacity ? arena->capacity * 2 : 256;
+		arena->entries = realloc(arena->entries, arena->capacity * sizeof arena->entries[0]);
+	}
+
+	/* Clear the padding too, images of the arena should be reproducible. */
+	memset(&arena->entries[arena->sz], 0, sizeof arena->entries[0]);
+	arena->entries[arena->sz].type = type;
+	arena->entries[arena->sz].data = data;
+	arena->sz++;
+}
+
 /*
- * Parses expressions of the form: C-t hello enter.
- * Returns 0 on success. Mangles the input string.
+ * Parses expressions of the form: C-t hello enter, appending the
+ * resulting entries to the arena. Returns 0 on success (in which
+ * case the macro occupies the entries added since the call), or -1
+ * on failure (leaving the arena untouched). Mangles the input
+ * string.
  */
 
-int macro_parse(char *s, struct macro *macro)
+int macro_parse(char *s, struct macro_arena *arena)
 {
 	char *tok;
+	size_t start = arena->sz;
+
+	#define ADD_ENTRY(t, d) arena_push(arena, t, d)
 
-	#define ADD_ENTRY(t, d) do { \
-		if (macro->sz >= ARRAY_SIZE(macro->entries)) { \
-			err("maximum macro size (%d) exceeded", ARRAY_SIZE(macro->entries)); \
-			return -1; \
-		} \
-		macro->entries[macro->sz].type = t; \
-		macro->entries[macro->sz].data = d; \
-		macro->sz++; \
-	} while(0)
-
-	macro->sz = 0;
 	for (tok = strtok(s, " "); tok; tok = strtok(NULL, " ")) {
 		uint8_t code, mods;
 		size_t len = strlen(tok);
@@ -39,6 +48,7 @@ int macro_parse(char *s, struct macro *macro)
 					ADD_ENTRY(MACRO_HOLD, code);
 				else {
 					err("%s is not a valid key", key);
+					arena->sz = start;
 					return -1;
 				}
 			}
@@ -51,25 +61,12 @@ int macro_parse(char *s, struct macro *macro)
 			int chrsz;
 
 			while ((chrsz=utf8_read_char(tok, &codepoint))) {
-				int i;
 				int xcode;
 
 				if (chrsz == 1 && codepoint < 128) {
-					for (i = 0; i < 256; i++) {
-						const char *name = keycode_table[i].name;
-						const char *shiftname = keycode_table[i].shifted_name;
-
-						if (name && name[0] == tok[0] && name[1] == 0) {
-							ADD_ENTRY(MACRO_KEYSEQUENCE, i);
-							break;
-						}
-
-						if (shiftname && shiftname[0] == tok[0] && shiftname[1] == 0) {
-							ADD_ENTRY(MACRO_KEYSEQUENCE, (MOD_SHIFT << 8) | i);
-							break;
-						}
-					}
-				} else if ((xcode = unicode_lookup_index(codepoint)) > 0)
+					if (!lookup_char(codepoint, &code, &mods))
+						ADD_ENTRY(MACRO_KEYSEQUENCE, (mods << 8) | code);
+				} else if ((xcode = unicode_lookup_index(codepoint)) >= 0)
 					ADD_ENTRY(MACRO_UNICODE, xcode);
 
 				tok += chrsz;
@@ -82,7 +79,18 @@ int macro_parse(char *s, struct macro *macro)
 	#undef ADD_ENTRY
 }
 
+void macro_arena_free(struct macro_arena *arena)
+{
+	free(arena->entries);
+	memset(arena, 0, sizeof *arena);
+}
+
+/*
+ * Executes the given macro by invoking output() for each key transition and
+ * delay() (which is not expected to block) for each pause.
+ */
 long macro_execute(void (*output)(void *ctx, uint8_t, uint8_t),
+		   void (*delay)(void *ctx, long usec),
 		   void *ctx,
 		   const struct macro *macro, size_t timeout)
 {
@@ -94,7 +102,7 @@ long macro_execute(void (*output)(void *ctx, uint8_t, uint8_t),
 		const struct macro_entry *ent = &macro->entries[i];
 
 		switch (ent->type) {
-			size_t j;
+			size_t j, n;
 			uint16_t idx;
 			uint8_t codes[4];
 			uint8_t code, mods;
@@ -121,9 +129,9 @@ long macro_execute(void (*output)(void *ctx, uint8_t, uint8_t),
 		case MACRO_UNICODE:
 			idx = ent->data;
 
-			unicode_get_sequence(idx, codes);
+			n = unicode_get_sequence(idx, codes);
 
-			for (j = 0; j < 4; j++) {
+			for (j = 0; j < n; j++) {
 				output(ctx, codes[j], 1);
 				output(ctx, codes[j], 0);
 			}
@@ -141,8 +149,10 @@ long macro_execute(void (*output)(void *ctx, uint8_t, uint8_t),
 					output(ctx, code, 1);
 			}
 
-			if (mods && timeout)
-				usleep(timeout);
+			if (mods && timeout) {
+				delay(ctx, timeout);
+				time += timeout;
+			}
 
 			output(ctx, code, 1);
 			output(ctx, code, 0);
@@ -158,16 +168,118 @@ long macro_execute(void (*output)(void *ctx, uint8_t, uint8_t),
 
 			break;
 		case MACRO_TIMEOUT:
-			usleep(ent->data * 1E3);
-			time += ent->data;
+			delay(ctx, ent->data * 1000);
+			time += ent->data * 1000;
 			break;
 		}
 
 		if (timeout) {
-			usleep(timeout);
-			time += timeout/1E3;
+			delay(ctx, timeout);
+			time += timeout;
 		}
 	}
 
 	return time;
 }
+
+static struct macro_step *queue_tail(struct macro_queue *q)
+{
+	return &q->steps[(q->start + q->sz - 1) % q->capacity];
+}
+
+static void queue_push(struct macro_queue *q, uint8_t code, uint8_t pressed, uint32_t delay)
+{
+	struct macro_step *step;
+
+	/*
+	 * Should only happen if a sufficiently long macro is triggered
+	 * repeatedly. Grow the ring (unwrapping it in the process) rather
+	 * than emitting anything ahead of its delay.
+	 */
+	if (q->sz == q->capacity) {
+		size_t i;
+		size_t capacity = q->capacity ? q->capacity * 2 : 256;
+		struct macro_step *steps = malloc(capacity * sizeof steps[0]);
+
+		for (i = 0; i < q->sz; i++)
+			steps[i] = q->steps[(q->start + i) % q->capacity];
+
+		free(q->steps);
+
+		q->steps = steps;
+		q->capacity = capacity;
+		q->start = 0;
+	}
+
+	step = &q->steps[(q->start + q->sz) % q->capacity];
+
+	step->code = code;
+	step->pressed = pressed;
+	step->delay = delay;
+
+	q->sz++;
+}
+
+/*
+ * Emits the given key transition immediately if nothing is pending,
+ * otherwise queues it behind the pending output.
+ */
+void macro_queue_output(struct macro_queue *q, uint8_t code, uint8_t pressed,
+			void (*output)(void *ctx, uint8_t, uint8_t), void *ctx)
+{
+	if (!q->sz)
+		output(ctx, code, pressed);
+	else
+		queue_push(q, code, pressed, 0);
+}
+
+/*
+ * Delays all subsequent output by the given number of microseconds.
+ * time should correspond to the current time.
+ */
+void macro_queue_delay(struct macro_queue *q, uint64_t time, long usec)
+{
+	if (!q->sz)
+		q->time = time;
+
+	if (q->sz && !queue_tail(q)->code)
+		queue_tail(q)->delay += usec;
+	else
+		queue_push(q, 0, 0, usec);
+}
+
+/* Returns the time at which the next step becomes due, or 0 if the queue is empty. */
+uint64_t macro_queue_deadline(const struct macro_queue *q)
+{
+	return q->sz ? q->time + q->steps[q->start].delay : 0;
+}
+
+/*
+ * Emits all output which is due at the given time. Returns the time at
+ * which the next step becomes due, or 0 if the queue is empty.
+ */
+uint64_t macro_queue_drain(struct macro_queue *q, uint64_t time,
+			   void (*output)(void *ctx, uint8_t, uint8_t), void *ctx)
+{
+	while (q->sz) {
+		struct macro_step *step = &q->steps[q->start];
+
+		if (q->time + step->delay > time)
+			return q->time + step->delay;
+
+		q->time += step->delay;
+		if (step->code)
+			output(ctx, step->code, step->pressed);
+
+		q->start = (q->start + 1) % q->capacity;
+		q->sz--;
+	}
+
+	return 0;
+}
+
+void macro_queue_free(struct macro_queue *q)
+{
+	free(q->steps);
+	memset(q, 0, sizeof *q);
+}
@@ -4,33 +4,73 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-struct macro_entry {
-	enum {
-		MACRO_KEYSEQUENCE,
-		MACRO_HOLD,
-		MACRO_RELEASE,
-		MACRO_UNICODE,
-		MACRO_TIMEOUT
-	} type;
+enum {
+	MACRO_KEYSEQUENCE,
+	MACRO_HOLD,
+	MACRO_RELEASE,
+	MACRO_UNICODE,
+	MACRO_TIMEOUT
+};
 
+struct macro_entry {
+	uint8_t type;
 	uint16_t data;
 };
 
 /*
  * A series of key sequences optionally punctuated by
- * timeouts
+ * timeouts. The entries are stored elsewhere (usually
+ * in a macro_arena).
  */
 struct macro {
-	struct macro_entry entries[256];
+	const struct macro_entry *entries;
+	size_t sz;
+};
 
-	uint32_t sz;
+/* Contiguous storage for the entries of any number of macros. */
+struct macro_arena {
+	struct macro_entry *entries;
+	size_t sz;
+	size_t capacity;
 };
 
+/*
+ * Output which is yet to be emitted, along with the delays separating it.
+ * Allows macros to be executed from the event loop without blocking.
+ */
+struct macro_queue {
+	struct macro_step {
+		/* 0 for steps which only introduce a delay. */
+		uint8_t code;
+		uint8_t pressed;
 
+		/* The time (in microseconds) to wait before emitting the step. */
+		uint32_t delay;
+	} *steps;
+
+	size_t capacity;
+	size_t start;
+	size_t sz;
+
+	/* The time at which the last step was emitted. */
+	uint64_t time;
+};
+
+/* Returns the total delay of the macro in microseconds. */
 long macro_execute(void (*output)(void *, uint8_t, uint8_t),
+		   void (*delay)(void *, long),
 		   void *ctx,
 		   const struct macro *macro,
 		   size_t timeout);
 
-int macro_parse(char *s, struct macro *macro);
+void macro_queue_output(struct macro_queue *q, uint8_t code, uint8_t pressed,
+			void (*output)(void *, uint8_t, uint8_t), void *ctx);
+void macro_queue_delay(struct macro_queue *q, uint64_t time, long usec);
+uint64_t macro_queue_deadline(const struct macro_queue *q);
+uint64_t macro_queue_drain(struct macro_queue *q, uint64_t time,
+			   void (*output)(void *, uint8_t, uint8_t), void *ctx);
+void macro_queue_free(struct macro_queue *q);
+
+int macro_parse(char *s, struct macro_arena *arena);
+void macro_arena_free(struct macro_arena *arena);
 #endif
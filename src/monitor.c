@@ -30,9 +30,9 @@ static void cleanup(void)
 	set_tflags(ICANON|ECHO, 1);
 }
 
-int event_handler(struct event *ev)
+static void event_handler(struct event *ev)
 {
-	static long last_time = 0;
+	static uint64_t last_time = 0;
 
 	switch (ev->type) {
 	const char *name;
@@ -51,7 +51,7 @@ int event_handler(struct event *ev)
 			name = keycode_table[ev->devev->code].name;
 
 			if (time_flag && last_time)
-				keyd_log("r{+%ld} ms\t", ev->timestamp - last_time);
+				keyd_log("r{+%.3f} ms\t", (ev->timestamp - last_time) / 1000.0);
 
 			keyd_log("%s\t%s\t%s %s\n",
 				 ev->dev->name, ev->dev->id,
@@ -73,7 +73,6 @@ int event_handler(struct event *ev)
 	fflush(stderr);
 
 	last_time = ev->timestamp;
-	return 0;
 }
 
 int monitor(int argc, char *argv[])
@@ -51,6 +51,11 @@
  * <35k of them).  Each codepoint is zero-left padded to 3 characters to avoid
  * the subset issue.
  *
+ * Frequently used codepoints (e.g Latin-1 and common emoji) are placed at the
+ * start of the table and assigned 2 digit sequences instead. The first digits
+ * used by these are excluded from the 3 digit sequences, so that no sequence
+ * is a prefix of another.
+ *
  * Finally, we use cancel as our compose prefix so the user doesn't have to
  * faff about with XkbOptions. This technically introduces the possibility of a
  * conflict, but I haven't found any evidence which suggests that Linefeed is
@@ -60,7 +65,13 @@
  */
 
 
+/*
+ * The number of distinct sequences: 324 two digit ones (first digits 0-8)
+ * and 3 digit ones for the remaining 27 first digits.
+ */
+#define UNICODE_NR_SEQUENCES (324 + 27 * 36 * 36)
+
 int unicode_lookup_index(uint32_t codepoint);
-void unicode_get_sequence(int idx, uint8_t codes[4]);
+int unicode_get_sequence(int idx, uint8_t codes[4]);
 
 #endif
@@ -12,11 +12,18 @@ struct vkbd;
 
 struct vkbd *vkbd_init(const char *name);
 
-void vkbd_mouse_move(const struct vkbd *vkbd, int x, int y);
-void vkbd_mouse_move_abs(const struct vkbd *vkbd, int x, int y);
-void vkbd_mouse_scroll(const struct vkbd *vkbd, int x, int y);
+void vkbd_mouse_move(struct vkbd *vkbd, int x, int y);
+void vkbd_mouse_move_abs(struct vkbd *vkbd, int x, int y);
+void vkbd_mouse_scroll(struct vkbd *vkbd, int x, int y);
 
-void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state);
+void vkbd_send_key(struct vkbd *vkbd, uint8_t code, int state);
+
+/*
+ * Submit any buffered output. Returns the CLOCK_MONOTONIC time (in
+ * microseconds) at which vkbd_flush() must be called again to submit output
+ * which could not be written yet, or 0 if everything was written.
+ */
+uint64_t vkbd_flush(struct vkbd *vkbd);
 
 void free_vkbd(struct vkbd *vkbd);
 #endif
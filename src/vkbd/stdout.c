@@ -22,26 +22,32 @@ struct vkbd *vkbd_init(const char *name)
 	return NULL;
 }
 
-void vkbd_mouse_scroll(const struct vkbd *vkbd, int x, int y)
+void vkbd_mouse_scroll(struct vkbd *vkbd, int x, int y)
 {
 	printf("mouse scroll: x: %d, y: %d\n", x, y);
 }
 
-void vkbd_mouse_move(const struct vkbd *vkbd, int x, int y)
+void vkbd_mouse_move(struct vkbd *vkbd, int x, int y)
 {
 	printf("mouse movement: x: %d, y: %d\n", x, y);
 }
 
-void vkbd_mouse_move_abs(const struct vkbd *vkbd, int x, int y)
+void vkbd_mouse_move_abs(struct vkbd *vkbd, int x, int y)
 {
 	printf("absolute mouse movement: x: %d, y: %d\n", x, y);
 }
 
-void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
+void vkbd_send_key(struct vkbd *vkbd, uint8_t code, int state)
 {
 	printf("key: %s, state: %d\n", keycode_table[code].name, state);
 }
 
+uint64_t vkbd_flush(struct vkbd *vkbd)
+{
+	fflush(stdout);
+	return 0;
+}
+
 void free_vkbd(struct vkbd *vkbd)
 {
 }
@@ -9,7 +9,6 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <pthread.h>
 #include <time.h>
 #include <errno.h>
 
@@ -26,9 +25,40 @@
 
 #include "../keyd.h"
 
+/* The initial capacity of the output queue, which grows as required. */
+#define MAX_QUEUED_EVENTS 1024
+
+/*
+ * The minimum amount of time (in microseconds) which must elapse between a
+ * keyboard write and a subsequent pointer button event. Events which are
+ * written to different devices in quick succession may otherwise be observed
+ * out of order by userspace (e.g a modified click). Pointer motion and wheel
+ * events are not subject to the delay, but are never reordered with respect
+ * to buttons.
+ */
+#define POINTER_DELAY 1000
+
+/*
+ * Output is accumulated in a single queue (in submission order) and
+ * written out by vkbd_flush(). Consecutive events destined for the same
+ * device are submitted with a single write().
+ */
 struct vkbd {
 	int fd;
 	int pfd;
+
+	struct input_event *queue;
+	uint8_t *pointer; /* One of the POINTER_* values below. */
+	size_t queue_sz;
+	size_t queue_capacity;
+
+	/* Set if the queue ends with an unterminated keyboard report. */
+	int kbd_report_open;
+
+	/* Keys which have changed state within the open keyboard report. */
+	uint8_t reported[256];
+
+	long long last_kbd_write;
 };
 
 static int create_virtual_keyboard(const char *name)
@@ -157,191 +187,254 @@ static int create_virtual_pointer(const char *name)
 	return fd;
 }
 
-static void write_key_event(const struct vkbd *vkbd, uint8_t code, int state)
-{
-	static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-	struct input_event ev;
-	int fd;
-	int is_btn;
+enum {
+	POINTER_NONE,
+	POINTER_MOTION,
+	POINTER_BUTTON,
+};
 
-	pthread_mutex_lock(&mtx);
+static long long get_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-	fd = vkbd->fd;
+/*
+ * Writes as much of the queue as possible without violating POINTER_DELAY.
+ * Returns the number of microseconds which must elapse before the rest of
+ * the queue can be written, or 0 if the queue was fully drained.
+ */
+static long long submit(struct vkbd *vkbd)
+{
+	size_t start = 0;
+	long long wait = 0;
 
-	ev.type = EV_KEY;
+	while (start < vkbd->queue_sz) {
+		size_t end = start;
+		int is_pointer = vkbd->pointer[start] != POINTER_NONE;
 
-	is_btn = 1;
-	switch (code) {
-		case KEYD_LEFT_MOUSE:	 ev.code = BTN_LEFT; break;
-		case KEYD_MIDDLE_MOUSE:	 ev.code = BTN_MIDDLE; break;
-		case KEYD_RIGHT_MOUSE:	 ev.code = BTN_RIGHT; break;
-		case KEYD_MOUSE_1:	 ev.code = BTN_SIDE; break;
-		case KEYD_MOUSE_2:	 ev.code = BTN_EXTRA; break;
-		case KEYD_MOUSE_BACK:	 ev.code = BTN_BACK; break;
-		case KEYD_MOUSE_FORWARD: ev.code = BTN_FORWARD; break;
-		case KEYD_ZOOM:		 ev.code = KEY_ZOOM; is_btn = 0; break;
-		case KEYD_VOICECOMMAND: ev.code = KEY_VOICECOMMAND; is_btn = 0; break;
-		default:
-			ev.code = code;
-			is_btn = 0;
-			break;
-	}
+		while (end < vkbd->queue_sz &&
+		       (vkbd->pointer[end] != POINTER_NONE) == is_pointer)
+			end++;
 
-	/*
-	 * Send all buttons through the virtual pointer
-	 * to prevent X from identifying the virtual
-	 * keyboard as a mouse.
-	 */
-	if (is_btn) {
-		fd = vkbd->pfd;
+		if (is_pointer) {
+			size_t button = start;
+			long long elapsed = get_time_us() - vkbd->last_kbd_write;
 
-		/*
-		 * Give key events preceding a mouse click
-		 * a chance to propagate to avoid event
-		 * order transposition. A bit kludegy,
-		 * but better than waiting for all events
-		 * to propagate and then checking them
-		 * on re-entry.
-		 *
-		 * TODO: fixme (maybe)
-		 */
-		usleep(1000);
-	}
+			while (button < end && vkbd->pointer[button] != POINTER_BUTTON)
+				button++;
 
-	ev.value = state;
+			/* Motion preceding the first button may be written immediately. */
+			if (button < end && elapsed < POINTER_DELAY) {
+				if (button > start)
+					xwrite(vkbd->pfd, &vkbd->queue[start],
+					       (button - start) * sizeof(struct input_event));
 
-	ev.input_event_sec = 0;
-	ev.input_event_usec = 0;
+				start = button;
+				wait = POINTER_DELAY - elapsed;
+				break;
+			}
 
-	xwrite(fd, &ev, sizeof(ev));
+			xwrite(vkbd->pfd, &vkbd->queue[start],
+			       (end - start) * sizeof(struct input_event));
+		} else {
+			xwrite(vkbd->fd, &vkbd->queue[start],
+			       (end - start) * sizeof(struct input_event));
 
-	ev.type = EV_SYN;
-	ev.code = 0;
-	ev.value = 0;
+			vkbd->last_kbd_write = get_time_us();
+		}
 
+		start = end;
+	}
 
-	xwrite(fd, &ev, sizeof(ev));
+	vkbd->queue_sz -= start;
+	memmove(vkbd->queue, vkbd->queue + start,
+		vkbd->queue_sz * sizeof(struct input_event));
+	memmove(vkbd->pointer, vkbd->pointer + start, vkbd->queue_sz);
 
-	pthread_mutex_unlock(&mtx);
+	return wait;
 }
 
-struct vkbd *vkbd_init(const char *name)
+/* Blocks until the queue has been written out, only used on exit. */
+static void drain(struct vkbd *vkbd)
 {
-	pthread_t tid;
-
-	struct vkbd *vkbd = calloc(1, sizeof vkbd);
-	vkbd->fd = create_virtual_keyboard(name);
-	vkbd->pfd = create_virtual_pointer("keyd virtual pointer");
+	long long wait;
 
-	return vkbd;
+	while ((wait = submit(vkbd)))
+		usleep(wait);
 }
 
-void vkbd_mouse_move(const struct vkbd *vkbd, int x, int y)
+static void append_event(struct vkbd *vkbd, int pointer, int type, int code, int value)
 {
-	struct input_event ev;
-
-	if (x) {
-		ev.type = EV_REL;
-		ev.code = REL_X;
-		ev.value = x;
+	struct input_event *ev;
 
-		ev.input_event_sec = 0;
-		ev.input_event_usec = 0;
+	/* Should only happen for very long macros. */
+	if (vkbd->queue_sz == vkbd->queue_capacity) {
+		size_t capacity = vkbd->queue_capacity ?
+			vkbd->queue_capacity * 2 : MAX_QUEUED_EVENTS;
+		struct input_event *queue;
+		uint8_t *pointer;
 
-		xwrite(vkbd->pfd, &ev, sizeof(ev));
-	}
-
-	if (y) {
-		ev.type = EV_REL;
-		ev.code = REL_Y;
-		ev.value = y;
+		if (!(queue = realloc(vkbd->queue, capacity * sizeof(struct input_event)))) {
+			perror("realloc");
+			exit(-1);
+		}
+		vkbd->queue = queue;
 
-		ev.input_event_sec = 0;
-		ev.input_event_usec = 0;
+		if (!(pointer = realloc(vkbd->pointer, capacity))) {
+			perror("realloc");
+			exit(-1);
+		}
+		vkbd->pointer = pointer;
 
-		xwrite(vkbd->pfd, &ev, sizeof(ev));
+		vkbd->queue_capacity = capacity;
 	}
 
-	ev.type = EV_SYN;
-	ev.code = 0;
-	ev.value = 0;
+	vkbd->pointer[vkbd->queue_sz] = pointer;
+	ev = &vkbd->queue[vkbd->queue_sz++];
 
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+
+	ev->input_event_sec = 0;
+	ev->input_event_usec = 0;
 }
 
-void vkbd_mouse_scroll(const struct vkbd *vkbd, int x, int y)
+static void close_kbd_report(struct vkbd *vkbd)
 {
-	struct input_event ev;
-
-	ev.type = EV_REL;
-	ev.code = REL_WHEEL;
-	ev.value = y;
+	if (vkbd->kbd_report_open) {
+		append_event(vkbd, POINTER_NONE, EV_SYN, 0, 0);
+		memset(vkbd->reported, 0, sizeof vkbd->reported);
 
-	ev.input_event_sec = 0;
-	ev.input_event_usec = 0;
+		vkbd->kbd_report_open = 0;
+	}
+}
 
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+static void queue_pointer_event(struct vkbd *vkbd, int type, int code, int value)
+{
+	close_kbd_report(vkbd);
+	append_event(vkbd, type == EV_KEY ? POINTER_BUTTON : POINTER_MOTION,
+		     type, code, value);
+}
 
-	ev.type = EV_REL;
-	ev.code = REL_HWHEEL;
-	ev.value = x;
+static void write_key_event(struct vkbd *vkbd, uint8_t code, int state)
+{
+	int is_btn;
+	uint16_t evcode;
 
-	ev.input_event_sec = 0;
-	ev.input_event_usec = 0;
+	is_btn = 1;
+	switch (code) {
+		case KEYD_LEFT_MOUSE:	 evcode = BTN_LEFT; break;
+		case KEYD_MIDDLE_MOUSE:	 evcode = BTN_MIDDLE; break;
+		case KEYD_RIGHT_MOUSE:	 evcode = BTN_RIGHT; break;
+		case KEYD_MOUSE_1:	 evcode = BTN_SIDE; break;
+		case KEYD_MOUSE_2:	 evcode = BTN_EXTRA; break;
+		case KEYD_MOUSE_BACK:	 evcode = BTN_BACK; break;
+		case KEYD_MOUSE_FORWARD: evcode = BTN_FORWARD; break;
+		case KEYD_ZOOM:		 evcode = KEY_ZOOM; is_btn = 0; break;
+		case KEYD_VOICECOMMAND: evcode = KEY_VOICECOMMAND; is_btn = 0; break;
+		default:
+			evcode = code;
+			is_btn = 0;
+			break;
+	}
 
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+	/*
+	 * Send all buttons through the virtual pointer
+	 * to prevent X from identifying the virtual
+	 * keyboard as a mouse.
+	 */
+	if (is_btn) {
+		/*
+		 * Pointer events are queued behind any preceding
+		 * keyboard events and submitted once they have had
+		 * a chance to propagate (see POINTER_DELAY).
+		 */
+		queue_pointer_event(vkbd, EV_KEY, evcode, state);
+		queue_pointer_event(vkbd, EV_SYN, 0, 0);
+	} else {
+		/*
+		 * Multiple keys may change state within a single report, but a
+		 * given key may only change state once (much like a physical
+		 * keyboard), so start a new report if necessary.
+		 */
+		if (vkbd->reported[code])
+			close_kbd_report(vkbd);
 
-	ev.type = EV_SYN;
-	ev.code = 0;
-	ev.value = 0;
+		append_event(vkbd, POINTER_NONE, EV_KEY, evcode, state);
 
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+		vkbd->reported[code] = 1;
+		vkbd->kbd_report_open = 1;
+	}
 }
 
-void vkbd_mouse_move_abs(const struct vkbd *vkbd, int x, int y)
+struct vkbd *vkbd_init(const char *name)
 {
-	struct input_event ev;
+	struct vkbd *vkbd = calloc(1, sizeof *vkbd);
+	vkbd->fd = create_virtual_keyboard(name);
+	vkbd->pfd = create_virtual_pointer("keyd virtual pointer");
 
-	if (x) {
-		ev.type = EV_ABS;
-		ev.code = ABS_X;
-		ev.value = x;
+	return vkbd;
+}
 
-		ev.input_event_sec = 0;
-		ev.input_event_usec = 0;
+void vkbd_mouse_move(struct vkbd *vkbd, int x, int y)
+{
+	if (x)
+		queue_pointer_event(vkbd, EV_REL, REL_X, x);
 
-		xwrite(vkbd->pfd, &ev, sizeof(ev));
-	}
+	if (y)
+		queue_pointer_event(vkbd, EV_REL, REL_Y, y);
 
-	if (y) {
-		ev.type = EV_ABS;
-		ev.code = ABS_Y;
-		ev.value = y;
+	queue_pointer_event(vkbd, EV_SYN, 0, 0);
+}
 
-		ev.input_event_sec = 0;
-		ev.input_event_usec = 0;
+void vkbd_mouse_scroll(struct vkbd *vkbd, int x, int y)
+{
+	queue_pointer_event(vkbd, EV_REL, REL_WHEEL, y);
+	queue_pointer_event(vkbd, EV_REL, REL_HWHEEL, x);
+	queue_pointer_event(vkbd, EV_SYN, 0, 0);
+}
 
-		xwrite(vkbd->pfd, &ev, sizeof(ev));
-	}
+void vkbd_mouse_move_abs(struct vkbd *vkbd, int x, int y)
+{
+	if (x)
+		queue_pointer_event(vkbd, EV_ABS, ABS_X, x);
 
-	ev.type = EV_SYN;
-	ev.code = 0;
-	ev.value = 0;
+	if (y)
+		queue_pointer_event(vkbd, EV_ABS, ABS_Y, y);
 
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+	queue_pointer_event(vkbd, EV_SYN, 0, 0);
 }
 
-void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
+void vkbd_send_key(struct vkbd *vkbd, uint8_t code, int state)
 {
 	dbg("output %s %s", KEY_NAME(code), state == 1 ? "down" : "up");
 
 	write_key_event(vkbd, code, state);
 }
 
+uint64_t vkbd_flush(struct vkbd *vkbd)
+{
+	long long wait;
+
+	close_kbd_report(vkbd);
+	wait = submit(vkbd);
+
+	return wait ? vkbd->last_kbd_write + POINTER_DELAY : 0;
+}
+
 void free_vkbd(struct vkbd *vkbd)
 {
 	if (vkbd) {
+		close_kbd_report(vkbd);
+		drain(vkbd);
+
 		close(vkbd->fd);
+		close(vkbd->pfd);
+		free(vkbd->queue);
+		free(vkbd->pointer);
 		free(vkbd);
 	}
 }
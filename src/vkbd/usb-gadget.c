@@ -39,7 +39,7 @@ static int create_virtual_keyboard(void)
 	return fd;
 }
 
-static void send_hid_report(const struct vkbd *vkbd)
+static void send_hid_report(struct vkbd *vkbd)
 {
 
 	struct hid_report report;
@@ -128,28 +128,28 @@ static void update_key_state(uint16_t code, int state)
 
 struct vkbd *vkbd_init(const char *name)
 {
-	struct vkbd *vkbd = calloc(1, sizeof vkbd);
+	struct vkbd *vkbd = calloc(1, sizeof *vkbd);
 	vkbd->fd = create_virtual_keyboard();
 
 	return vkbd;
 }
 
-void vkbd_mouse_move(const struct vkbd *vkbd, int x, int y)
+void vkbd_mouse_move(struct vkbd *vkbd, int x, int y)
 {
 	fprintf(stderr, "usb-gadget: mouse support is not implemented\n");
 }
 
-void vkbd_mouse_move_abs(const struct vkbd *vkbd, int x, int y)
+void vkbd_mouse_move_abs(struct vkbd *vkbd, int x, int y)
 {
 	fprintf(stderr, "usb-gadget: mouse support is not implemented\n");
 }
 
-void vkbd_mouse_scroll(const struct vkbd *vkbd, int x, int y)
+void vkbd_mouse_scroll(struct vkbd *vkbd, int x, int y)
 {
 	fprintf(stderr, "usb-gadget: mouse support is not implemented\n");
 }
 
-void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
+void vkbd_send_key(struct vkbd *vkbd, uint8_t code, int state)
 {
 	if (update_modifier_state(code, state) < 0)
 		update_key_state(code, state);
@@ -157,6 +157,11 @@ void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
 	send_hid_report(vkbd);
 }
 
+uint64_t vkbd_flush(struct vkbd *vkbd)
+{
+	return 0;
+}
+
 void free_vkbd(struct vkbd *vkbd)
 {
 	close(vkbd->fd);
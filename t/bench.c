@@ -0,0 +1,221 @@
+/*
+ * Measures the time taken to look up a key (and to process a key event)
+ * while several layers and the composites they form are active, using the
+ * layer table in t/bench.conf. Also measures the time taken to parse key
+ * names and the config itself, and to translate CJK text into compose
+ * sequences (as done by keyd input).
+ *
+ * Usage: make bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Included directly for access to lookup_descriptor(). */
+#include "../src/keyboard.c"
+
+#define ITERATIONS 100000
+
+static size_t noutput = 0;
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_send_key(uint8_t code, uint8_t pressed)
+{
+	noutput++;
+}
+
+static void bench_on_layer_change(const struct keyboard *kbd, const struct layer *layer, uint8_t active)
+{
+}
+
+/*
+ * Fills buf with kana and CJK compatibility ideographs (the unified
+ * ideographs only appear as range endpoints in UnicodeData.txt).
+ */
+static size_t cjk_text(char *buf, size_t sz)
+{
+	size_t n = 0;
+	uint32_t i = 0;
+
+	while (n + 4 < sz) {
+		uint32_t cp = i % 2 ? 0x3041 + i % 86 : 0xf900 + i % 256;
+
+		buf[n++] = 0xe0 | cp >> 12;
+		buf[n++] = 0x80 | (cp >> 6 & 0x3f);
+		buf[n++] = 0x80 | (cp & 0x3f);
+		i++;
+	}
+
+	buf[n] = 0;
+	return n;
+}
+
+static void bench_press(struct keyboard *kbd, uint8_t code, uint8_t pressed, uint64_t time)
+{
+	struct key_event ev = {
+		.code = code,
+		.pressed = pressed,
+		.timestamp = time,
+	};
+
+	kbd_process_events(kbd, &ev, 1);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i, j;
+	uint64_t start, elapsed;
+	uint64_t time = 0;
+	size_t nevents = 0;
+	size_t nlookups = 0;
+	uint8_t sink = 0;
+
+	struct config config;
+	struct keyboard *kbd;
+
+	/* Activates l0, l1 and l2, and hence 3 of the composites. */
+	const uint8_t layer_keys[] = { KEYD_F1, KEYD_F2, KEYD_F3 };
+	const uint8_t keys[] = {
+		KEYD_A, KEYD_B, KEYD_C, KEYD_D, KEYD_E, KEYD_F, KEYD_G,
+		KEYD_H, KEYD_I, KEYD_J, KEYD_K, KEYD_L, KEYD_M, KEYD_N,
+		KEYD_O, KEYD_P, KEYD_Q, KEYD_R, KEYD_S, KEYD_T, KEYD_U,
+		KEYD_V, KEYD_W, KEYD_X, KEYD_Y, KEYD_Z,
+	};
+
+	struct output output = {
+		.send_key = bench_send_key,
+		.on_layer_change = bench_on_layer_change,
+	};
+
+	if (argc != 2) {
+		printf("usage: %s <config>\n", argv[0]);
+		return -1;
+	}
+
+	start = get_time_ns();
+	for (i = 0; i < ITERATIONS / 10; i++) {
+		for (j = 0; j < 256; j++) {
+			uint8_t code, mods;
+			const char *name = keycode_table[j].name;
+
+			if (name && !parse_key_sequence(name, &code, &mods)) {
+				sink += code;
+				nlookups++;
+			}
+		}
+	}
+	elapsed = get_time_ns() - start;
+
+	printf("%zu key names parsed: %.1f ns/name (%d)\n",
+	       nlookups, (double)elapsed / nlookups, sink);
+	nlookups = 0;
+
+	start = get_time_ns();
+	for (i = 0; i < 100; i++) {
+		if (config_parse(&config, argv[1])) {
+			printf("Failed to parse config %s\n", argv[1]);
+			return -1;
+		}
+
+		config_free(&config);
+	}
+	elapsed = get_time_ns() - start;
+
+	printf("config parsed: %.1f us/parse\n", (double)elapsed / 100 / 1000);
+
+	if (config_parse(&config, argv[1])) {
+		printf("Failed to parse config %s\n", argv[1]);
+		return -1;
+	}
+
+	kbd = new_keyboard(&config, &output);
+
+	for (i = 0; i < ARRAY_SIZE(layer_keys); i++)
+		bench_press(kbd, layer_keys[i], 1, time++);
+
+	start = get_time_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		for (j = 0; j < ARRAY_SIZE(keys); j++) {
+			struct descriptor d;
+			int dl;
+
+			lookup_descriptor(kbd, keys[j], &d, &dl);
+			sink += d.args[0].code + dl;
+			nlookups++;
+		}
+	}
+	elapsed = get_time_ns() - start;
+
+	printf("%zu layers, %zu lookups: %.1f ns/lookup (%d)\n",
+	       config.nr_layers, nlookups, (double)elapsed / nlookups, sink);
+
+	/* Bypasses the lookup cache. */
+	start = get_time_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		for (j = 0; j < ARRAY_SIZE(keys); j++) {
+			struct descriptor d;
+			int dl;
+
+			resolve_descriptor(kbd, keys[j], &d, &dl);
+			sink += d.args[0].code + dl;
+		}
+	}
+	elapsed = get_time_ns() - start;
+
+	printf("%zu layers, %zu resolutions: %.1f ns/resolution (%d)\n",
+	       config.nr_layers, nlookups, (double)elapsed / nlookups, sink);
+
+	start = get_time_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		for (j = 0; j < ARRAY_SIZE(keys); j++) {
+			bench_press(kbd, keys[j], 1, time++);
+			bench_press(kbd, keys[j], 0, time++);
+			nevents += 2;
+		}
+	}
+	elapsed = get_time_ns() - start;
+
+	printf("%zu layers, %zu events: %.1f ns/event\n",
+	       config.nr_layers, nevents, (double)elapsed / nevents);
+
+	{
+		char text[4096];
+		size_t nchars = 0;
+
+		cjk_text(text, sizeof text);
+
+		start = get_time_ns();
+		for (i = 0; i < ITERATIONS / 100; i++) {
+			const char *c = text;
+			uint32_t codepoint;
+			int csz;
+
+			while ((csz = utf8_read_char(c, &codepoint))) {
+				uint8_t codes[4];
+				int idx = unicode_lookup_index(codepoint);
+
+				if (idx >= 0) {
+					int n = unicode_get_sequence(idx, codes);
+					sink += codes[n-1];
+				}
+
+				c += csz;
+				nchars++;
+			}
+		}
+		elapsed = get_time_ns() - start;
+
+		printf("%zu bytes of CJK text, %zu characters: %.1f ns/character (%d)\n",
+		       sizeof text, nchars, (double)elapsed / nchars, sink);
+	}
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+#!/usr/bin/python3
+
+# Hammers keyd with interleaved key/click sequences and verifies that the
+# resulting events are observed in the correct order across the virtual
+# keyboard and pointer. Also reports the input->output latency.
+#
+# Expects keyd to be running with test.conf (see run.sh).
+
+import fcntl
+import glob
+import os
+import selectors
+import signal
+import struct
+import sys
+import time
+from ctypes import c_char_p
+
+import keys
+
+EV_SYN = 0x00
+EV_KEY = 0x01
+
+ITERATIONS = 200
+
+
+def on_timeout(a, b):
+    print('ERROR: test timed out')
+    exit(-1)
+
+
+signal.signal(signal.SIGALRM, on_timeout)
+signal.alarm(20)
+
+
+class VirtualKeyboard():
+    def __init__(self, name, product_id, vendor_id):
+        UI_SET_EVBIT = 0x40045564
+        UI_SET_KEYBIT = 0x40045565
+        UI_DEV_SETUP = 0x405c5503
+        UI_DEV_CREATE = 0x5501
+        BUS_USB = 0x03
+
+        self.uinp = os.open("/dev/uinput", os.O_WRONLY | os.O_NONBLOCK)
+        fcntl.ioctl(self.uinp, UI_SET_EVBIT, EV_KEY)
+        fcntl.ioctl(self.uinp, UI_SET_EVBIT, EV_SYN)
+
+        for _, key in keys.names.items():
+            if not keys.is_mouse_button(key):
+                fcntl.ioctl(self.uinp, UI_SET_KEYBIT, key.code)
+
+        setup_struct = struct.pack('HHHH80bI',
+                                   BUS_USB,
+                                   vendor_id,
+                                   product_id,
+                                   0,
+                                   *([ord(c) for c in name] +
+                                     ([0] * (80 - len(name)))),
+                                   0)
+
+        fcntl.ioctl(self.uinp, UI_DEV_SETUP, setup_struct)
+        fcntl.ioctl(self.uinp, UI_DEV_CREATE)
+
+        time.sleep(.3)
+
+    def tap(self, name):
+        code = keys.names[name].code
+
+        for pressed in (1, 0):
+            os.write(self.uinp, struct.pack("llHHi", 0, 0, EV_KEY, code, pressed) +
+                     struct.pack("llHHi", 0, 0, EV_SYN, 0, 0))
+
+
+def open_device(name):
+    EVIOCGNAME = 0x81004506
+    EVIOCGRAB = 0x40044590
+
+    for f in glob.glob("/dev/input/event*"):
+        fh = open(f, 'rb', buffering=0)
+        devname = fcntl.ioctl(fh, EVIOCGNAME, bytes(256))
+
+        if c_char_p(devname).value.decode('utf8') == name:
+            fcntl.ioctl(fh, EVIOCGRAB, 1)
+            os.set_blocking(fh.fileno(), False)
+            return fh
+
+    raise Exception(f'Could not find "{name}"')
+
+
+# Returns a list of (timestamp, key, value) tuples ordered by timestamp.
+def collect(devices, n, timeout=1):
+    events = []
+    sel = selectors.DefaultSelector()
+
+    for fh in devices:
+        sel.register(fh, selectors.EVENT_READ)
+
+    end = time.time() + timeout
+    while len(events) < n and time.time() < end:
+        for k, _ in sel.select(end - time.time()):
+            while True:
+                ev = k.fileobj.read(24)
+                if not ev:
+                    break
+
+                sec, usec, type, code, value = struct.unpack("llHHi", ev)
+                if type == EV_KEY:
+                    events.append((sec + usec / 1E6, keys.codes[code].name, value))
+
+    sel.close()
+    return sorted(events, key=lambda e: e[0])
+
+
+vkbd = VirtualKeyboard('test keyboard', vendor_id=0x2fac, product_id=0x2ade)
+kbd = open_device("keyd virtual keyboard")
+pointer = open_device("keyd virtual pointer")
+
+# f9 is bound to leftmouse in test.conf.
+sequence = ['x', 'f9', 'y', 'f9']
+expected = []
+for k in sequence:
+    name = 'btn left' if k == 'f9' else k
+    expected += [(name, 1), (name, 0)]
+
+failed = False
+latencies = []
+
+for i in range(ITERATIONS):
+    start = time.time()
+
+    for k in sequence:
+        vkbd.tap(k)
+
+    events = collect([kbd, pointer], len(expected))
+    result = [(k, v) for _, k, v in events]
+
+    if result != expected:
+        print(f'\x1b[31mERROR\x1b[0m: iteration {i}: expected {expected}, got {result}')
+        failed = True
+        break
+
+    latencies.append(events[-1][0] - start)
+
+if not failed:
+    latencies.sort()
+    print('click-order: \x1b[33mPASSED\x1b[0m (%d iterations, median latency: %.0f us, max: %.0f us)' % (
+        ITERATIONS,
+        latencies[len(latencies)//2] * 1E6,
+        latencies[-1] * 1E6))
+
+sys.exit(-1 if failed else 0)
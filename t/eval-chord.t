@@ -0,0 +1,25 @@
+eval j+k = d
+eval x+y = e
+j down
+k down
+200ms
+j up
+k up
+x down
+y down
+200ms
+x up
+y up
+eval reset
+j down
+k down
+200ms
+j up
+k up
+
+d down
+d up
+e down
+e up
+c down
+c up
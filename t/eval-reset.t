@@ -0,0 +1,11 @@
+eval x = overload(control, macro(hi))
+x down
+eval reset
+x up
+b down
+b up
+
+leftcontrol down
+leftcontrol up
+b down
+b up
@@ -0,0 +1,16 @@
+# Releases are processed before presses within a frame, so the overload
+# resolves as a tap even though the kernel reported the press first
+# (outside of a frame the same events produce C-b).
+z down
+frame
+b down
+z up
+syn
+b up
+
+control down
+control up
+enter down
+enter up
+b down
+b up
@@ -0,0 +1,21 @@
+f10 down
+f10 up
+50ms
+2:x down
+2:x up
+x down
+x up
+100ms
+y down
+y up
+
+a down
+a up
+x down
+x up
+b down
+b up
+x down
+x up
+y down
+y up
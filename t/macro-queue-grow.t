@@ -0,0 +1,435 @@
+f22 down
+f22 up
+20ms
+f22 down
+f22 up
+300ms
+x down
+x up
+
+a down
+a up
+b down
+b up
+a down
+a up
+b down
+b up
+c down
+c up
+d down
+d up
+e down
+e up
+f down
+f up
+g down
+g up
+h down
+h up
+i down
+i up
+j down
+j up
+k down
+k up
+l down
+l up
+m down
+m up
+n down
+n up
+o down
+o up
+p down
+p up
+q down
+q up
+r down
+r up
+s down
+s up
+t down
+t up
+u down
+u up
+v down
+v up
+w down
+w up
+x down
+x up
+y down
+y up
+z down
+z up
+a down
+a up
+b down
+b up
+c down
+c up
+d down
+d up
+e down
+e up
+f down
+f up
+g down
+g up
+h down
+h up
+i down
+i up
+j down
+j up
+k down
+k up
+l down
+l up
+m down
+m up
+n down
+n up
+o down
+o up
+p down
+p up
+q down
+q up
+r down
+r up
+s down
+s up
+t down
+t up
+u down
+u up
+v down
+v up
+w down
+w up
+x down
+x up
+y down
+y up
+z down
+z up
+a down
+a up
+b down
+b up
+c down
+c up
+d down
+d up
+e down
+e up
+f down
+f up
+g down
+g up
+h down
+h up
+i down
+i up
+j down
+j up
+k down
+k up
+l down
+l up
+m down
+m up
+n down
+n up
+o down
+o up
+p down
+p up
+q down
+q up
+r down
+r up
+s down
+s up
+t down
+t up
+u down
+u up
+v down
+v up
+w down
+w up
+x down
+x up
+y down
+y up
+z down
+z up
+a down
+a up
+b down
+b up
+c down
+c up
+d down
+d up
+e down
+e up
+f down
+f up
+g down
+g up
+h down
+h up
+i down
+i up
+j down
+j up
+k down
+k up
+l down
+l up
+m down
+m up
+n down
+n up
+o down
+o up
+p down
+p up
+q down
+q up
+r down
+r up
+s down
+s up
+t down
+t up
+u down
+u up
+v down
+v up
+w down
+w up
+x down
+x up
+y down
+y up
+z down
+z up
+a down
+a up
+b down
+b up
+a down
+a up
+b down
+b up
+c down
+c up
+d down
+d up
+e down
+e up
+f down
+f up
+g down
+g up
+h down
+h up
+i down
+i up
+j down
+j up
+k down
+k up
+l down
+l up
+m down
+m up
+n down
+n up
+o down
+o up
+p down
+p up
+q down
+q up
+r down
+r up
+s down
+s up
+t down
+t up
+u down
+u up
+v down
+v up
+w down
+w up
+x down
+x up
+y down
+y up
+z down
+z up
+a down
+a up
+b down
+b up
+c down
+c up
+d down
+d up
+e down
+e up
+f down
+f up
+g down
+g up
+h down
+h up
+i down
+i up
+j down
+j up
+k down
+k up
+l down
+l up
+m down
+m up
+n down
+n up
+o down
+o up
+p down
+p up
+q down
+q up
+r down
+r up
+s down
+s up
+t down
+t up
+u down
+u up
+v down
+v up
+w down
+w up
+x down
+x up
+y down
+y up
+z down
+z up
+a down
+a up
+b down
+b up
+c down
+c up
+d down
+d up
+e down
+e up
+f down
+f up
+g down
+g up
+h down
+h up
+i down
+i up
+j down
+j up
+k down
+k up
+l down
+l up
+m down
+m up
+n down
+n up
+o down
+o up
+p down
+p up
+q down
+q up
+r down
+r up
+s down
+s up
+t down
+t up
+u down
+u up
+v down
+v up
+w down
+w up
+x down
+x up
+y down
+y up
+z down
+z up
+a down
+a up
+b down
+b up
+c down
+c up
+d down
+d up
+e down
+e up
+f down
+f up
+g down
+g up
+h down
+h up
+i down
+i up
+j down
+j up
+k down
+k up
+l down
+l up
+m down
+m up
+n down
+n up
+o down
+o up
+p down
+p up
+q down
+q up
+r down
+r up
+s down
+s up
+t down
+t up
+u down
+u up
+v down
+v up
+w down
+w up
+x down
+x up
+y down
+y up
+z down
+z up
+x down
+x up
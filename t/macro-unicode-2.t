@@ -9,12 +9,10 @@ control up
 1 up
 cancel down
 cancel up
-o down
-o up
-y down
-y up
-6 down
-6 up
+7 down
+7 up
+3 down
+3 up
 2 down
 2 up
 control down
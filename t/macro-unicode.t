@@ -1,11 +1,17 @@
 \ down
 \ up
+f23 down
+f23 up
 
 cancel down
 cancel up
-o down
-o up
-y down
-y up
-6 down
-6 up
+7 down
+7 up
+3 down
+3 up
+cancel down
+cancel up
+0 down
+0 up
+0 down
+0 up
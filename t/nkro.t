@@ -0,0 +1,137 @@
+g down
+h down
+i down
+n down
+q down
+t down
+u down
+v down
+x down
+y down
+0 down
+f1 down
+f2 down
+f3 down
+f4 down
+f5 down
+f6 down
+f7 down
+f8 down
+f11 down
+f12 down
+f13 down
+f14 down
+f15 down
+f16 down
+f17 down
+f18 down
+f19 down
+f20 down
+kp1 down
+kp2 down
+kp3 down
+kp4 down
+kp5 down
+g up
+h up
+i up
+n up
+q up
+t up
+u up
+v up
+x up
+y up
+0 up
+f1 up
+f2 up
+f3 up
+f4 up
+f5 up
+f6 up
+f7 up
+f8 up
+f11 up
+f12 up
+f13 up
+f14 up
+f15 up
+f16 up
+f17 up
+f18 up
+f19 up
+f20 up
+kp1 up
+kp2 up
+kp3 up
+kp4 up
+kp5 up
+
+g down
+h down
+i down
+n down
+q down
+t down
+u down
+v down
+x down
+y down
+0 down
+f1 down
+f2 down
+f3 down
+f4 down
+f5 down
+f6 down
+f7 down
+f8 down
+f11 down
+f12 down
+f13 down
+f14 down
+f15 down
+f16 down
+f17 down
+f18 down
+f19 down
+f20 down
+kp1 down
+kp2 down
+kp3 down
+kp4 down
+kp5 down
+g up
+h up
+i up
+n up
+q up
+t up
+u up
+v up
+x up
+y up
+0 up
+f1 up
+f2 up
+f3 up
+f4 up
+f5 up
+f6 up
+f7 up
+f8 up
+f11 up
+f12 up
+f13 up
+f14 up
+f15 up
+f16 up
+f17 up
+f18 up
+f19 up
+f20 up
+kp1 up
+kp2 up
+kp3 up
+kp4 up
+kp5 up
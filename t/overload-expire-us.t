@@ -0,0 +1,17 @@
+6 down
+5001us
+6 up
+x down
+x up
+6 down
+4999us
+6 up
+
+control down
+control up
+x down
+x up
+control down
+control up
+esc down
+esc up
@@ -37,5 +37,5 @@ if [ $# -ne 0 ]; then
 	cleanup
 fi
 
-./runner.py -ev *.t
+./runner.py -ev *.t && ./click-order.py
 cleanup
@@ -268,6 +268,13 @@ def run_test(name, input, output, verbose):
         except:
             pass
 
+        try:
+            timeout = int(re.match('^([0-9]+)us$', line).group(1))
+            elements.append(TestElement('timeout', 0, timeout / 1000))
+            continue
+        except:
+            pass
+
         key, state = line.split(' ')
         depress = 0
 
@@ -5,9 +5,23 @@
 
 #define MAX_EVENTS 1024
 
+/*
+ * Input lines may be prefixed with the number of the keyboard which
+ * generates them (e.g 2:a down), all keyboards share the same output.
+ * Lines of the form 'eval <exp>' are passed to kbd_eval() (e.g eval
+ * a = b) on the first keyboard. Events between a 'frame' and a 'syn'
+ * line are delivered as a single input frame (see kbd_process_frame()).
+ */
+#define MAX_KEYBOARDS 2
+
 struct key_event output[MAX_EVENTS];
 size_t noutput = 0;
 
+static struct keyboard *keyboards[MAX_KEYBOARDS];
+
+/* The pending timeout of each keyboard (0 if unarmed). */
+static uint64_t timeouts[MAX_KEYBOARDS];
+
 static uint64_t get_time_ns()
 {
 	struct timespec ts;
@@ -128,13 +142,16 @@ static int print_diff(struct key_event *expected, size_t nexp,
 	return ret;
 }
 
-static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
+static int parse_events(char *s, struct key_event in[MAX_EVENTS], int kbds[MAX_EVENTS],
+			const char *exps[MAX_EVENTS], int frames[MAX_EVENTS], size_t *nin,
 			struct key_event out[MAX_EVENTS], size_t *nout)
 {
 	int ret;
-	int time = 0;
+	uint64_t time = 0;
 	int ln = 0;
 	int n = 0;
+	int frame = 0;
+	int nr_frames = 0;
 	struct key_event *events = in;
 
 	char *line = s;
@@ -167,13 +184,34 @@ static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
 			goto next;
 		}
 
-		if (len >= 2 && line[len - 1] == 's' && line[len - 2] == 'm') {
+		if (events == in && !strcmp(line, "frame")) {
+			frame = ++nr_frames;
+		} else if (events == in && !strcmp(line, "syn")) {
+			frame = 0;
+		} else if (events == in && !strncmp(line, "eval ", 5)) {
+			/* A code of 0 marks an expression. */
+			assert(n < MAX_EVENTS);
+			events[n].code = 0;
+			events[n].timestamp = time;
+			kbds[n] = 0;
+			exps[n] = line + 5;
+			frames[n] = 0;
+			n++;
+		} else if (len >= 2 && line[len - 1] == 's' && line[len - 2] == 'm') {
+			time += atoi(line) * 1000;
+		} else if (len >= 2 && line[len - 1] == 's' && line[len - 2] == 'u') {
 			time += atoi(line);
 		} else {
 			uint8_t code;
+			int kbd = 0;
 			char *k = strtok(line, " ");
 			char *v = strtok(NULL, " \n");
 
+			if (events == in && k[0] >= '1' && k[0] <= '0' + MAX_KEYBOARDS && k[1] == ':') {
+				kbd = k[0] - '1';
+				k += 2;
+			}
+
 			if (!v || (strcmp(v, "up") && strcmp(v, "down"))) {
 				printf("%d: Invalid line\n", ln);
 				goto next;
@@ -189,6 +227,11 @@ static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
 			events[n].code = code;
 			events[n].pressed = !strcmp(v, "down");
 			events[n].timestamp = time;
+			if (events == in) {
+				kbds[n] = kbd;
+				exps[n] = NULL;
+				frames[n] = frame;
+			}
 			n++;
 		}
 
@@ -200,18 +243,49 @@ static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
 	return 0;
 }
 
-uint64_t run_test(struct keyboard *kbd, const char *path)
+/*
+ * Expires the timeouts of all keyboards other than the given one which fall
+ * due at or before the given time (the timeouts of the keyboard which
+ * receives the next batch of input are processed by kbd_process_events()).
+ */
+static void advance(int kbd, uint64_t time)
 {
+	while (1) {
+		int i;
+		int next = -1;
+		struct key_event ev = {0};
+
+		for (i = 0; i < MAX_KEYBOARDS; i++)
+			if (i != kbd && timeouts[i] && timeouts[i] <= time &&
+			    (next == -1 || timeouts[i] < timeouts[next]))
+				next = i;
+
+		if (next == -1)
+			break;
+
+		ev.timestamp = timeouts[next];
+		timeouts[next] = 0;
+
+		kbd_process_events(keyboards[next], &ev, 1);
+	}
+}
+
+uint64_t run_test(const char *path)
+{
+	size_t i, j;
 	uint64_t time;
 	char *data = read_file(path);
 
 	struct key_event input[MAX_EVENTS];
+	int kbds[MAX_EVENTS];
+	const char *exps[MAX_EVENTS];
+	int frames[MAX_EVENTS];
 	size_t ninput;
 
 	struct key_event expected[MAX_EVENTS];
 	size_t nexpected;
 
-	if (parse_events(data, input, &ninput, expected, &nexpected) < 0) {
+	if (parse_events(data, input, kbds, exps, frames, &ninput, expected, &nexpected) < 0) {
 		fprintf(stderr, "Failed to parse input\n");
 		exit(-1);
 	}
@@ -219,7 +293,28 @@ uint64_t run_test(struct keyboard *kbd, const char *path)
 	noutput = 0;
 
 	time = get_time_ns();
-	kbd_process_events(kbd, input, ninput);
+	/* Consecutive events from the same keyboard are processed as a batch. */
+	for (i = 0; i < ninput; i = j) {
+		advance(kbds[i], input[i].timestamp);
+
+		if (exps[i]) {
+			if (kbd_eval(keyboards[kbds[i]], exps[i]) < 0) {
+				printf("%s: failed to evaluate %s\n", path, exps[i]);
+				exit(-1);
+			}
+
+			j = i + 1;
+			continue;
+		}
+
+		for (j = i; j < ninput && kbds[j] == kbds[i] && !exps[j] && frames[j] == frames[i]; j++)
+			;
+
+		if (frames[i])
+			kbd_process_frame(keyboards[kbds[i]], &input[i], j - i);
+		else
+			kbd_process_events(keyboards[kbds[i]], &input[i], j - i);
+	}
 	time = get_time_ns()-time;
 
 	if (cmp_events(output, noutput, expected, nexpected)) {
@@ -233,6 +328,15 @@ uint64_t run_test(struct keyboard *kbd, const char *path)
 	return time;
 }
 
+static void set_timeout(const struct keyboard *kbd, uint64_t time)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_KEYBOARDS; i++)
+		if (keyboards[i] == kbd)
+			timeouts[i] = time;
+}
+
 static void on_layer_change(const struct keyboard *kbd, const struct layer *layer, uint8_t active)
 {
 }
@@ -241,13 +345,12 @@ int main(int argc, char *argv[])
 {
 	size_t i;
 	struct config config;
-	uint64_t total_time;
-
-	struct keyboard *kbd;
+	uint64_t total_time = 0;
 
 	struct output output = {
 		.send_key = send_key,
 		.on_layer_change = on_layer_change,
+		.set_timeout = set_timeout,
 	};
 
 	if (argc < 2) {
@@ -262,10 +365,11 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	kbd = new_keyboard(&config, &output);
+	for (i = 0; i < MAX_KEYBOARDS; i++)
+		keyboards[i] = new_keyboard(&config, &output);
 
 	for (i = 2; i < argc; i++)
-		total_time += run_test(kbd, argv[i]);
+		total_time += run_test(argv[i]);
 
 	printf("\nTotal time spent in the main loop: %zu us\n", total_time/1000);
 	return 0;